@@ -1,6 +1,15 @@
-import java.util.LinkedList;
+import biz.source_code.utils.RawConsoleInput;
+import java.io.FileDescriptor;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.OutputStream;
+import java.nio.charset.StandardCharsets;
 import java.util.Arrays;
-import java.util.Random;
+import java.util.PriorityQueue;
+import java.util.concurrent.BlockingQueue;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.TimeUnit;
+import sun.misc.Signal;
 
 public class Box {
 
@@ -20,7 +29,7 @@ public class Box {
                     }
                 }
 
-                System.out.printf("\r\n%c   %s", key.character > 0 ? key.character : ' ', key);
+                System.out.printf("\r\n%c   %s", Console.character > 0 ? Console.character : ' ', key);
 
                 if (key == Ascii.EndOfText || key == Ascii.EndOfTransmission) {
                     System.exit(0);
@@ -50,23 +59,33 @@ public class Box {
 class Layer {
     final int width;
     final int height;
-    final char[] buffer;
+    final long[] buffer; // packed cells, see Cell
+    final long[] dirtyRows; // one bit per row changed since the row was last composited
+    final long[] usedRows;  // one bit per row written since the last erase
 
     int column = 0;
     int row = 0;
-    boolean dirty = false;
 
     Layer(int width, int height) {
         this.width = width;
         this.height = height;
-        this.buffer = new char[width * height];
+        this.buffer = new long[width * height];
+        this.dirtyRows = new long[(height + 63) >>> 6];
+        this.usedRows = new long[(height + 63) >>> 6];
     }
 
+    /// Clears only the rows written since the last erase.
     Layer erase() {
         this.column = 0;
         this.row = 0;
-        this.dirty = false;
-        Arrays.fill(this.buffer, '\0');
+        for (int word = 0; word < usedRows.length; word++) {
+            for (long bits = usedRows[word]; bits != 0; bits &= bits - 1) {
+                int row = (word << 6) + Long.numberOfTrailingZeros(bits);
+                Arrays.fill(this.buffer, row * width, (row + 1) * width, Cell.EMPTY);
+            }
+            dirtyRows[word] |= usedRows[word];
+            usedRows[word] = 0L;
+        }
         return this;
     }
 
@@ -75,49 +94,140 @@ class Layer {
     }
 
     Layer column(int column) {
-        this.dirty = true;
         this.column = (column + width) % width;
         return this;
     }
 
     Layer row(int row) {
-        this.dirty = true;
         this.row = (row + height) % height;
         return this;
     }
 
-    Layer put(char character) {
-        dirty = true;
-        buffer[row * width + column] = character;
-        return this;
+    /// A plain character is a cell with the default colors, so put('x') works as expected.
+    Layer put(long cell) {
+        return put(column, row, cell);
     }
 
-    Layer put(int column, int row, char character) {
-        dirty = true;
-        buffer[row * width + column] = character;
+    Layer put(int column, int row, long cell) {
+        buffer[row * width + column] = cell;
+        dirtyRows[row >>> 6] |= 1L << row;
+        usedRows[row >>> 6] |= 1L << row;
         return this;
     }
 
-    char get() {
+    long get() {
         return this.buffer[row * this.width + column];
     }
 }
 
+/**
+ * Merges layers, the first one on top, into the cells that go to the screen.
+ * A cell is taken from the topmost layer where it is not empty.
+ * Only the rows that are dirty in some layer are merged again.
+ */
+class Compositor {
+    final Layer[] layers;
+    final int width;
+    final int height;
+    final long[] cells;
+    final long[] dirtyRows; // rows merged but not rendered yet
+
+    Compositor(Layer... layers) {
+        this.layers = layers;
+        this.width = layers[0].width;
+        this.height = layers[0].height;
+        this.cells = new long[width * height];
+        this.dirtyRows = new long[(height + 63) >>> 6];
+        for (Layer layer : layers) { // nothing has been merged yet
+            Arrays.fill(layer.dirtyRows, -1L);
+        }
+    }
+
+    /// Merges the dirty rows; returns true if there is something to render.
+    boolean compose() {
+        boolean changed = false;
+        for (int word = 0; word < dirtyRows.length; word++) {
+            long bits = 0L;
+            for (Layer layer : layers) {
+                bits |= layer.dirtyRows[word];
+                layer.dirtyRows[word] = 0L;
+            }
+            if (word == dirtyRows.length - 1 && (height & 63) != 0) {
+                bits &= (1L << (height & 63)) - 1; // bits beyond the last row
+            }
+            dirtyRows[word] |= bits;
+            changed |= bits != 0;
+            for (; bits != 0; bits &= bits - 1) {
+                composeRow((word << 6) + Long.numberOfTrailingZeros(bits));
+            }
+        }
+        return changed;
+    }
+
+    void composeRow(int row) {
+        for (int i = row * width; i < (row + 1) * width; i++) {
+            long cell = Cell.BLANK;
+            for (Layer layer : layers) {
+                if (!Cell.isEmpty(layer.buffer[i])) {
+                    cell = layer.buffer[i];
+                    break;
+                }
+            }
+            cells[i] = cell;
+        }
+    }
+}
+
 /** 
  * Intended for emulating a very simple editor.
  * Just to test how we can handle input.
  */
 class TextEditor {
-    Layer layer = new Layer(80, 25);
-    Layer overlay = new Layer(80, 25); // for animation magic
+    Layer layer;
+    Layer overlay; // for animation magic
+    Compositor compositor;
     boolean quit = false;
 
-    LinkedList<Effect> effects = new LinkedList<>();
+    final FrameClock clock = new FrameClock();
+    final BlinkingCursor cursor = new BlinkingCursor();
+
+    final BlockingQueue<Integer> events = new LinkedBlockingQueue<>(); // keys from the InputReader
+
+    TextEditor() {
+        this(Console.size()[0], Console.size()[1]);
+    }
+
+    TextEditor(int columns, int rows) {
+        allocate(new Layer(columns, rows));
+    }
+
+    void allocate(Layer layer) {
+        this.layer = layer;
+        this.overlay = new Layer(layer.width, layer.height);
+        this.compositor = new Compositor(overlay, layer);
+        this.cursor.target = layer;
+        this.cursor.row = -1;
+    }
+
+    /// Reallocates the layers for the new terminal size, keeping as much of the text as fits.
+    void resize() {
+        int[] size = Console.size();
+        if (size[0] == layer.width && size[1] == layer.height) {
+            return;
+        }
+        Layer resized = new Layer(size[0], size[1]);
+        for (int row = 0; row < Math.min(layer.height, resized.height); row++) {
+            System.arraycopy(layer.buffer, row * layer.width, resized.buffer, row * resized.width, Math.min(layer.width, resized.width));
+            resized.usedRows[row >>> 6] |= 1L << row;
+        }
+        resized.column(Math.min(layer.column, resized.width - 1)).row(Math.min(layer.row, resized.height - 1));
+        allocate(resized);
+        clock.clear(); // running effects may point at cells that no longer exist
+        Console.clearScreen();
+    }
 
-    void handleKeyboardInput() {
-        Ascii key = Console.readNonBlocking();
+    void handleKeyboardInput(Ascii key, int character) {
         if (key != Ascii.Nothing) {
-            layer.dirty = true;
             switch (key) {
             case ArrowUp:
                 layer.move(0, -1);
@@ -135,64 +245,195 @@ class TextEditor {
                 layer.column(0).move(0, +1);
                 break;
             case Backspace:
-                layer.move(-1, 0).put('\0');
+                layer.move(-1, 0).put(Cell.EMPTY);
                 break;
             case EndOfText:
             case EndOfTransmission:
+            case Error:
                 quit = true;
                 break;
+            case Resize:
+                resize();
+                break;
             default:
-                if (key.character > 0) {
-                    effects.add(new ChaoticCharacter(layer.column, layer.row, 3));
-                    layer.put(key.character).move(+1, 0);
-                } else {
-                    layer.dirty = false;
+                if (character > 0) {
+                    clock.schedule(new ChaoticCharacter(layer.column, layer.row, 3), System.nanoTime());
+                    layer.put(character).move(+1, 0);
                 }
             }
         }
     }
 
-    void applyEffects() {
-        overlay.erase().column(layer.column).row(layer.row);
-        for (var iterator = effects.iterator(); iterator.hasNext(); ) {
-            Effect effect = iterator.next();
-            if (!effect.apply(overlay)) {
-                iterator.remove();
-            }
-        }
+    void applyEffects(long now) {
+        clock.run(overlay, now);
     }
 
     void start() throws Exception {
-        effects.add(new BlinkingCursor());
-        //effects.add(new FpsCounter());
+        clock.schedule(cursor, System.nanoTime());
+        //clock.schedule(new FpsCounter(), System.nanoTime());
+        new InputReader(events).start();
+        try {
+            Signal.handle(new Signal("WINCH"), signal -> events.offer(KeyDecoder.event(Ascii.Resize, 0)));
+        } catch (IllegalArgumentException e) { // no such signal, e.g. on Windows
+        }
         while (!quit) {
-            handleKeyboardInput();
-            applyEffects();
-            if (layer.dirty || overlay.dirty) {
-                Console.render(layer, overlay);
-                layer.dirty = false;
-                overlay.dirty = false;
+            // sleep until a key comes or the next effect is due
+            Integer event = clock.isEmpty() ? events.take() : events.poll(clock.nextDeadline() - System.nanoTime(), TimeUnit.NANOSECONDS);
+            if (event != null) {
+                while (event != null && !quit) {
+                    handleKeyboardInput(KeyDecoder.key(event), KeyDecoder.codepoint(event));
+                    event = events.poll();
+                }
+                clock.reschedule(cursor, System.nanoTime()); // the cursor follows the keys right away
+            }
+            applyEffects(System.nanoTime());
+            if (compositor.compose()) {
+                Console.render(compositor);
             }
-            Thread.sleep(10L);
         }
     }
 }
 
+/**
+ * Blocks on the raw standard input and posts the decoded keys to a queue,
+ * so that the render loop does not have to poll for input.
+ */
+class InputReader extends Thread {
+    final FileInputStream in = new FileInputStream(FileDescriptor.in);
+    final KeyDecoder decoder = new KeyDecoder();
+    final byte[] buffer = new byte[4096];
+    final BlockingQueue<Integer> events;
+
+    InputReader(BlockingQueue<Integer> events) {
+        super("input-reader");
+        this.events = events;
+        setDaemon(true);
+    }
+
+    @Override
+    public void run() {
+        try {
+            int length;
+            while ((length = in.read(buffer)) > 0) {
+                decoder.feed(buffer, length);
+                while (!decoder.isEmpty()) {
+                    events.put(decoder.poll());
+                }
+            }
+        } catch (Exception e) {
+        }
+        events.offer(KeyDecoder.event(Ascii.Error, 0)); // end of input
+    }
+}
+
 @FunctionalInterface
 interface Effect {
-    /// Do something to layer.
-    /// Return false if the effect is no longer applicable and shall be removed.
-    boolean apply(Layer layer);
+    long DONE = Long.MIN_VALUE;
+
+    /// Do something to layer; now is the System.nanoTime() of the frame.
+    /// The layer is not erased between frames, the effect cleans up after itself.
+    /// Return the time when the effect wants to be applied next,
+    /// or DONE if the effect is no longer applicable and shall be removed.
+    long apply(Layer layer, long now);
+}
+
+/**
+ * Keeps the effects ordered by the time they want to be applied next,
+ * so that the render loop only wakes up when some effect is due.
+ */
+class FrameClock {
+    static final long TICK = 10_000_000L; // 10 ms, the pace of the animations
+
+    static final class Entry {
+        final Effect effect;
+        long deadline;
+
+        Entry(Effect effect, long deadline) {
+            this.effect = effect;
+            this.deadline = deadline;
+        }
+    }
+
+    // nanoTime values may overflow, so they are compared by their difference
+    final PriorityQueue<Entry> queue = new PriorityQueue<>((a, b) -> Long.signum(a.deadline - b.deadline));
+
+    boolean isEmpty() {
+        return queue.isEmpty();
+    }
+
+    long nextDeadline() {
+        return queue.peek().deadline;
+    }
+
+    void clear() {
+        queue.clear();
+    }
+
+    void schedule(Effect effect, long deadline) {
+        queue.add(new Entry(effect, deadline));
+    }
+
+    void reschedule(Effect effect, long deadline) {
+        for (Entry entry : queue) {
+            if (entry.effect == effect) {
+                queue.remove(entry);
+                entry.deadline = deadline;
+                queue.add(entry);
+                return;
+            }
+        }
+        schedule(effect, deadline);
+    }
+
+    /// Applies the effects that are due; the entries are reused, so a tick does not allocate.
+    void run(Layer layer, long now) {
+        while (!queue.isEmpty() && queue.peek().deadline - now <= 0) {
+            Entry entry = queue.poll();
+            long deadline = entry.effect.apply(layer, now);
+            if (deadline != Effect.DONE) {
+                entry.deadline = deadline - now > 0 ? deadline : now + 1; // never twice in the same frame
+                queue.add(entry);
+            }
+        }
+    }
+}
+
+/**
+ * Random numbers shared by all effects (xorshift64*).
+ * Does not allocate and is not thread-safe; effects only run on the render loop.
+ */
+final class FastRandom {
+    static long state = System.nanoTime() | 1L;
+
+    static int nextInt(int bound) {
+        state ^= state >>> 12;
+        state ^= state << 25;
+        state ^= state >>> 27;
+        return (int) (((state * 0x2545F4914F6CDD1DL) >>> 32) * bound >>> 32);
+    }
 }
 
 class BlinkingCursor implements Effect {
+    static final long PERIOD = 500_000_000L;
+
+    Layer target; // whose cursor blinks
+    int column = 0;
+    int row = -1; // where the cursor is drawn, -1 = not drawn
+
     @Override
-    public boolean apply(Layer layer) {
-        boolean appears = (System.currentTimeMillis() / 500) % 2 == 0;
+    public long apply(Layer layer, long now) {
+        if (row >= 0) {
+            layer.put(column, row, Cell.EMPTY);
+            row = -1;
+        }
+        long phase = Math.floorDiv(now, PERIOD);
+        boolean appears = phase % 2 == 0;
         if (appears) {
-            layer.put('_');
+            column = target.column;
+            row = target.row;
+            layer.put(column, row, '_');
         }
-        return true;
+        return (phase + 1) * PERIOD;
     }
 }
 
@@ -202,7 +443,6 @@ class ChaoticCharacter implements Effect {
     final int column;
     final int row;
     final int count;
-    final Random random = new Random();
     int i = 1;
 
     ChaoticCharacter(int column, int row, int count) {
@@ -212,13 +452,15 @@ class ChaoticCharacter implements Effect {
     }
 
     @Override
-    public boolean apply(Layer layer) {
+    public long apply(Layer layer, long now) {
         if (i > count) {
-            return false;
+            layer.put(column, row, Cell.EMPTY);
+            return DONE;
         }
-        layer.put(column, row, PALETTE.charAt(random.nextInt(PALETTE.length())));
+        int character = PALETTE.charAt(FastRandom.nextInt(PALETTE.length()));
+        layer.put(column, row, Cell.of(character, 2 + FastRandom.nextInt(6), Cell.DEFAULT, Cell.BOLD)); // red to cyan
         i += 1;
-        return true;
+        return now + FrameClock.TICK;
     }
 }
 
@@ -228,100 +470,471 @@ class FpsCounter implements Effect {
     long lastTick = System.nanoTime();
 
     @Override
-    public boolean apply(Layer layer) {
-        int ms = (int)((System.nanoTime() - lastTick) / 1_000_000L); // ms to render one frame
+    public long apply(Layer layer, long now) {
+        int ms = (int)((now - lastTick) / 1_000_000L); // ms to render one frame
         int fps = ms > 0 ? 1_000 / ms : 0;
-        lastTick = System.nanoTime();
+        lastTick = now;
         for (int i = 0; i < 5; i++) {
-            layer.put(79 - i, 24, DIGIT.charAt(fps % 10));
+            layer.put(layer.width - 1 - i, layer.height - 1, DIGIT.charAt(fps % 10));
             fps /= 10;
         }
-        return true;
+        return now + FrameClock.TICK;
     }
 }
 
 class Console {
     static final byte[] buffer = new byte[32];
+    static final KeyDecoder decoder = new KeyDecoder();
+    static int character = 0; // code point of the key last returned by readNonBlocking, 0 if it has none
+    static OutputStream out = new FileOutputStream(FileDescriptor.out); // replaceable for headless runs
+
+    static byte[] frame = new byte[0]; // bytes of the frame being built, reused between frames
+    static int frameLength = 0;
+    static long[] previous = new long[0]; // what the terminal shows right now; Cell.UNKNOWN = unknown
+    static int previousWidth = 0;
 
     static void rawMode() {
         try {
-            Runtime.getRuntime().exec(new String[]{"/bin/sh", "-c", "stty raw -echo </dev/tty"});
+            RawConsoleInput.setRawMode();
         } catch(Exception e) {
         }
     }
     
     static void cookedMode() {
         try {
-            Runtime.getRuntime().exec(new String[]{"/bin/sh", "-c", "stty -raw echo </dev/tty"});
+            RawConsoleInput.resetConsoleMode();
         } catch(Exception e) {
         }
     }
 
-    // static Size size() {
-    //     try {
-    //         String signals = "\033[s\033[5000;5000H\033[6n\033[u";
-    //         System.out.print(signals);
-    //         byte[] bytes = new byte[32];
-    //         int bytesRead = System.in.read(bytes);
-
-    //         for (int i = 0; i < bytesRead; i++) {
-    //             System.out.printf("%x", bytes[i]);
-    //             // 1b 5b 34 31 3b 31 37 39 52
-    //             // ^[41;179R 
-    //         }
-    //         System.out.print("\r\n");
-    //     } catch(Exception e) {
-    //     }
-    //     return new Size(10,10);
-    // }
+    /// Size of the terminal as {columns, rows}; 80x25 when it cannot be determined.
+    static int[] size() {
+        try {
+            int[] size = RawConsoleInput.getConsoleSize();
+            if (size != null) {
+                return size;
+            }
+        } catch (Exception e) {
+        }
+        return new int[] {80, 25};
+    }
     
     static void clearScreen() {
-        System.out.print("\033[2J\033[H");
+        write("\033[2J\033[H");
+        Arrays.fill(previous, Cell.UNKNOWN); // whatever was on the screen is gone
     }
 
     static void moveCursorTopLeft() {
-        System.out.print("\033[0;0H");
+        write("\033[0;0H");
     }
 
     static void hideCursor() {
-        System.out.print("\033[?25l");
+        write("\033[?25l");
     }
 
     static void showCursor() {
-        System.out.print("\033[?25h");
+        write("\033[?25h");
+    }
+
+    /// Escape sequences go through the same raw stream as the frames,
+    /// so that they cannot overtake or lag behind them.
+    static void write(String sequence) {
+        try {
+            out.write(sequence.getBytes(StandardCharsets.US_ASCII));
+        } catch (Exception e) {
+        }
     }
 
     static Ascii readNonBlocking() {
         try {
-            if (System.in.available() > 0) {
+            if (decoder.isEmpty() && System.in.available() > 0) {
                 Arrays.fill(buffer, (byte) 0);
-                System.in.read(buffer); 
-                return Ascii.from(buffer);
+                int length = System.in.read(buffer);
+                if (length > 0) {
+                    decoder.feed(buffer, length);
+                }
+            }
+            if (decoder.isEmpty()) {
+                character = 0;
+                return Ascii.Nothing;
             }
-            return Ascii.Nothing;
+            int event = decoder.poll();
+            character = KeyDecoder.codepoint(event);
+            return KeyDecoder.key(event);
         } catch (Exception e) {
             return Ascii.Error;
         }
     }
 
-    static void render(Layer layer, Layer overlay) {        
-        moveCursorTopLeft();
-        for (int row = 0; row < Math.min(25, layer.height); row++) {
-            for (int column = 0; column < Math.min(80, layer.width); column++) {
-                int i = layer.width * row + column;
-                System.out.print(firstNotNull(overlay.buffer[i], layer.buffer[i], ' '));
+    /// Builds the frame in one byte buffer and sends it with a single write.
+    /// Only the dirty rows are visited and only the cells that differ from the previous frame are sent.
+    /// Colors and styles are switched only where they change between the cells sent.
+    static void render(Compositor compositor) {
+        int width = compositor.width;
+        int height = compositor.height;
+        if (previous.length != width * height || previousWidth != width) {
+            previous = new long[width * height];
+            previousWidth = width;
+            Arrays.fill(previous, Cell.UNKNOWN);
+        }
+
+        frameLength = 0;
+        long pen = 0L; // attributes the terminal writes with; frames start and end with the default ones
+        int cursor = -1; // cell the terminal cursor is at, -1 = unknown
+        for (int row = 0; row < height; row++) {
+            long bit = 1L << row;
+            if ((compositor.dirtyRows[row >>> 6] & bit) == 0 && previous[width * row] != Cell.UNKNOWN) {
+                continue; // neither changed nor lost from the screen
+            }
+            compositor.dirtyRows[row >>> 6] &= ~bit;
+            for (int column = 0; column < width; column++) {
+                long cell = compositor.cells[width * row + column];
+                int i = width * row + column;
+                if (previous[i] == cell) {
+                    continue;
+                }
+                reserve();
+                if (cursor != i) {
+                    appendCursorPosition(column, row);
+                }
+                if (Cell.attributes(cell) != pen) {
+                    appendAttributes(pen, Cell.attributes(cell));
+                    pen = Cell.attributes(cell);
+                }
+                appendCharacter(Cell.codepoint(cell));
+                previous[i] = cell;
+                cursor = column + 1 < width ? i + 1 : -1; // do not rely on the wrapping at the right edge
+            }
+        }
+        if (pen != 0L) {
+            reserve();
+            appendAttributes(pen, 0L);
+        }
+
+        if (frameLength > 0) {
+            try {
+                out.write(frame, 0, frameLength);
+            } catch (Exception e) {
+            }
+        }
+    }
+
+    /// Makes room for more than any one cell takes.
+    static void reserve() {
+        if (frameLength + 64 > frame.length) {
+            frame = Arrays.copyOf(frame, Math.max(4096, 2 * frame.length));
+        }
+    }
+
+    static void appendCursorPosition(int column, int row) {
+        frame[frameLength++] = 0x1b;
+        frame[frameLength++] = '[';
+        appendNumber(row + 1);
+        frame[frameLength++] = ';';
+        appendNumber(column + 1);
+        frame[frameLength++] = 'H';
+    }
+
+    /// Emits one SGR sequence that turns the attributes from into the attributes to.
+    /// Only the parts that differ are sent; a reset is needed only when a style is turned off.
+    static void appendAttributes(long from, long to) {
+        frame[frameLength++] = 0x1b;
+        frame[frameLength++] = '[';
+        int start = frameLength;
+        int fromFlags = Cell.flags(from);
+        int toFlags = Cell.flags(to);
+        if ((fromFlags & ~toFlags) != 0) {
+            frame[frameLength++] = '0';
+            from = 0L;
+            fromFlags = 0;
+        }
+        if ((toFlags & ~fromFlags & Cell.BOLD) != 0) {
+            appendParameter(start, 1);
+        }
+        if ((toFlags & ~fromFlags & Cell.UNDERLINE) != 0) {
+            appendParameter(start, 4);
+        }
+        if ((toFlags & ~fromFlags & Cell.REVERSE) != 0) {
+            appendParameter(start, 7);
+        }
+        appendColor(start, Cell.foreground(from), Cell.foreground(to), 38, 39);
+        appendColor(start, Cell.background(from), Cell.background(to), 48, 49);
+        frame[frameLength++] = 'm';
+    }
+
+    static void appendColor(int start, int from, int to, int set, int reset) {
+        if (from == to) {
+            return;
+        }
+        if (to == Cell.DEFAULT) {
+            appendParameter(start, reset);
+        } else {
+            appendParameter(start, set);
+            frame[frameLength++] = ';';
+            frame[frameLength++] = '5';
+            frame[frameLength++] = ';';
+            appendNumber(to - 1);
+        }
+    }
+
+    static void appendParameter(int start, int parameter) {
+        if (frameLength > start) {
+            frame[frameLength++] = ';';
+        }
+        appendNumber(parameter);
+    }
+
+    static void appendNumber(int number) {
+        if (number >= 10) {
+            appendNumber(number / 10);
+        }
+        frame[frameLength++] = (byte) ('0' + number % 10);
+    }
+
+    static void appendCharacter(int codepoint) {
+        if (codepoint < 0x80) {
+            frame[frameLength++] = (byte) codepoint;
+        } else if (codepoint < 0x800) {
+            frame[frameLength++] = (byte) (0xc0 | (codepoint >> 6));
+            frame[frameLength++] = (byte) (0x80 | (codepoint & 0x3f));
+        } else if (codepoint < 0x10000) {
+            frame[frameLength++] = (byte) (0xe0 | (codepoint >> 12));
+            frame[frameLength++] = (byte) (0x80 | ((codepoint >> 6) & 0x3f));
+            frame[frameLength++] = (byte) (0x80 | (codepoint & 0x3f));
+        } else {
+            frame[frameLength++] = (byte) (0xf0 | (codepoint >> 18));
+            frame[frameLength++] = (byte) (0x80 | ((codepoint >> 12) & 0x3f));
+            frame[frameLength++] = (byte) (0x80 | ((codepoint >> 6) & 0x3f));
+            frame[frameLength++] = (byte) (0x80 | (codepoint & 0x3f));
+        }
+    }
+}
+
+/**
+ * A screen cell packed into a long: code point, foreground, background and style flags.
+ * Colors are indexes into the 256-color palette plus one; 0 is the terminal's default color.
+ * A cell with code point 0 is empty, i.e. transparent in a layer.
+ * With default colors and no flags the cell is just the code point.
+ */
+final class Cell {
+    static final long EMPTY = 0L;
+    static final long BLANK = ' ';
+    static final long UNKNOWN = -1L; // no real cell looks like this
+
+    static final int DEFAULT = 0;
+    static final int BOLD = 1;
+    static final int UNDERLINE = 2;
+    static final int REVERSE = 4;
+
+    static final long CODEPOINT_MASK = 0x1fffffL; // the lowest 21 bits
+    static final int FOREGROUND_SHIFT = 21;
+    static final int BACKGROUND_SHIFT = 30;
+    static final int FLAGS_SHIFT = 39;
+
+    static long of(int codepoint, int foreground, int background, int flags) {
+        return codepoint
+            | (long) foreground << FOREGROUND_SHIFT
+            | (long) background << BACKGROUND_SHIFT
+            | (long) flags << FLAGS_SHIFT;
+    }
+
+    static boolean isEmpty(long cell) {
+        return codepoint(cell) == 0;
+    }
+
+    static int codepoint(long cell) {
+        return (int) (cell & CODEPOINT_MASK);
+    }
+
+    /// The cell without its code point, for comparing how two cells look.
+    static long attributes(long cell) {
+        return cell & ~CODEPOINT_MASK;
+    }
+
+    static int foreground(long cell) {
+        return (int) (cell >>> FOREGROUND_SHIFT) & 0x1ff;
+    }
+
+    static int background(long cell) {
+        return (int) (cell >>> BACKGROUND_SHIFT) & 0x1ff;
+    }
+
+    static int flags(long cell) {
+        return (int) (cell >>> FLAGS_SHIFT) & 0xff;
+    }
+}
+
+/**
+ * Splits the raw input byte stream into keys.
+ * One read can bring several keys (fast typing, paste)
+ * and one key can be split between two reads.
+ */
+class KeyDecoder {
+    static final Ascii[] KEYS = Ascii.values();
+    static final int MAX_SEQUENCE = 32; // longer escape sequences are dropped as Unsupported
+
+    byte[] input = new byte[64]; // bytes not decoded yet, an incomplete key stays here until the next read
+    int inputLength = 0;
+    boolean discarding = false; // in the rest of a sequence that was too long, up to its final byte
+
+    int[] queue = new int[64]; // decoded keys, see event(); capacity is a power of two
+    int head = 0;
+    int tail = 0;
+
+    static int event(Ascii key, int codepoint) {
+        return key.ordinal() | codepoint << 8;
+    }
+
+    static Ascii key(int event) {
+        return KEYS[event & 0xff];
+    }
+
+    static int codepoint(int event) {
+        return event >>> 8;
+    }
+
+    boolean isEmpty() {
+        return head == tail;
+    }
+
+    int poll() {
+        int event = queue[head];
+        head = (head + 1) & (queue.length - 1);
+        return event;
+    }
+
+    void feed(byte[] bytes, int length) {
+        if (inputLength + length > input.length) {
+            input = Arrays.copyOf(input, Math.max(2 * input.length, inputLength + length));
+        }
+        System.arraycopy(bytes, 0, input, inputLength, length);
+        inputLength += length;
+
+        int i = 0;
+        while (i < inputLength) {
+            int consumed = decode(i);
+            if (consumed == 0) {
+                break; // incomplete, wait for more bytes
             }
-            System.out.print("\r\n");
+            i += consumed;
         }
+        System.arraycopy(input, i, input, 0, inputLength - i);
+        inputLength -= i;
     }
 
-    static char firstNotNull(char... characters) {
-        for (char ch : characters) {
-            if (ch != '\0') {
-                return ch;
+    /// Decodes one key starting at input[i].
+    /// Returns the number of bytes consumed, 0 if the key is not complete yet.
+    int decode(int i) {
+        if (discarding) {
+            int skipped = skipSequence(i);
+            if (skipped > 0) {
+                return skipped;
             }
         }
-        return ' ';
+        int b = input[i] & 0xff;
+        if (b == 0x1b) {
+            return decodeEscape(i);
+        }
+        if (b < 0x80) {
+            Ascii key = Ascii.from(b);
+            push(key, key.character);
+            return 1;
+        }
+
+        int length = b >= 0xf8 ? 0 : b >= 0xf0 ? 4 : b >= 0xe0 ? 3 : b >= 0xc0 ? 2 : 0;
+        if (length == 0) { // stray continuation byte or invalid lead byte
+            push(Ascii.Unsupported, 0);
+            return 1;
+        }
+        int codepoint = b & (0x7f >> length);
+        for (int k = 1; k < length; k++) {
+            if (i + k == inputLength) {
+                return 0;
+            }
+            int c = input[i + k] & 0xff;
+            if ((c & 0xc0) != 0x80) {
+                push(Ascii.Unsupported, 0);
+                return k;
+            }
+            codepoint = codepoint << 6 | (c & 0x3f);
+        }
+        push(Ascii.Unicode, codepoint);
+        return length;
+    }
+
+    int decodeEscape(int i) {
+        if (i + 1 == inputLength) {
+            // Terminals send an escape sequence in one piece,
+            // so an escape at the very end of a read is the Escape key itself.
+            push(Ascii.Escape, 0);
+            return 1;
+        }
+        int next = input[i + 1] & 0xff;
+        if (next == '[') {
+            int end = i + 2;
+            while (end < inputLength && (input[end] & 0xff) >= 0x20 && (input[end] & 0xff) < 0x40) {
+                end++; // parameter and intermediate bytes
+            }
+            if (end - i >= MAX_SEQUENCE) {
+                push(Ascii.Unsupported, 0); // once for the whole sequence, skipSequence drops the rest
+                discarding = true;
+                return end - i;
+            }
+            if (end == inputLength) {
+                return 0;
+            }
+            return pushSequence(i, end + 1 - i);
+        }
+        if (next == 'O') {
+            if (i + 2 == inputLength) {
+                return 0;
+            }
+            return pushSequence(i, 3);
+        }
+        push(Ascii.Escape, 0);
+        return 1;
+    }
+
+    /// Drops parameter and intermediate bytes starting at input[i], then the final byte once it is there.
+    /// Returns the number of bytes consumed.
+    int skipSequence(int i) {
+        int end = i;
+        while (end < inputLength && (input[end] & 0xff) >= 0x20 && (input[end] & 0xff) < 0x40) {
+            end++;
+        }
+        if (end == inputLength) {
+            return end - i; // the final byte comes with a later read
+        }
+        discarding = false;
+        int last = input[end] & 0xff;
+        return last >= 0x40 && last <= 0x7e ? end + 1 - i : end - i; // anything else is not part of the sequence
+    }
+
+    int pushSequence(int i, int length) {
+        if (length > 8) {
+            push(Ascii.Unsupported, 0); // does not fit into a packed code
+            return length;
+        }
+        long code = 0L;
+        for (int k = 0; k < length; k++) {
+            code |= ((long) (input[i + k] & 0xff)) << (8*k);
+        }
+        push(Ascii.from(code), 0);
+        return length;
+    }
+
+    void push(Ascii key, int codepoint) {
+        queue[tail] = event(key, codepoint);
+        tail = (tail + 1) & (queue.length - 1);
+        if (tail == head) { // full, double the capacity
+            int[] larger = new int[2 * queue.length];
+            int n = queue.length - head;
+            System.arraycopy(queue, head, larger, 0, n);
+            System.arraycopy(queue, 0, larger, n, head);
+            head = 0;
+            tail = queue.length;
+            queue = larger;
+        }
     }
 }
 
@@ -444,7 +1057,11 @@ enum Ascii {
     F8(encode("1b", "5b", "31", "39", "7e")),
     F9(encode("1b", "5b", "32", "30", "7e")),
     F10(encode("1b", "5b", "32", "31", "7e")),
+    F11(encode("1b", "5b", "32", "33", "7e")),
+    F12(encode("1b", "5b", "32", "34", "7e")),
     ShiftTab(encode("1b", "5b", "5a")),
+    Resize(-5), // not a key, the terminal has been resized
+    Unicode(-4), // any character outside of ASCII, the code point comes along with the key
     Unsupported(-1),
     Error(-3);
 
@@ -476,11 +1093,40 @@ enum Ascii {
         return code;
     }
 
+    // Open addressing hash table from code to key, built once at class init.
+    // The size is a power of two well above the number of keys, so probe chains stay short.
+    static final int TABLE_BITS = 8;
+    static final long[] CODES = new long[1 << TABLE_BITS];
+    static final Ascii[] KEYS = new Ascii[1 << TABLE_BITS];
+
+    static {
+        for (Ascii key : values()) {
+            if (key.code <= 0) {
+                continue; // pseudo keys: Nothing, Unsupported, Error
+            }
+            int slot = slot(key.code);
+            while (KEYS[slot] != null && CODES[slot] != key.code) {
+                slot = (slot + 1) & (KEYS.length - 1);
+            }
+            if (KEYS[slot] == null) { // the first key with the same code wins, e.g. Enter over CarriageReturn
+                CODES[slot] = key.code;
+                KEYS[slot] = key;
+            }
+        }
+    }
+
+    static int slot(long code) {
+        return (int) ((code * 0x9E3779B97F4A7C15L) >>> (64 - TABLE_BITS));
+    }
+
     static Ascii from(byte[] bytes) {
-        long code = encode(bytes);
-        for (Ascii key : Ascii.values()) {
-            if (key.code == code) {
-                return key;
+        return from(encode(bytes));
+    }
+
+    static Ascii from(long code) {
+        for (int slot = slot(code); KEYS[slot] != null; slot = (slot + 1) & (KEYS.length - 1)) {
+            if (CODES[slot] == code) {
+                return KEYS[slot];
             }
         }
         return Ascii.Unsupported;
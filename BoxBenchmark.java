@@ -0,0 +1,153 @@
+import java.io.ByteArrayOutputStream;
+import java.util.Arrays;
+import java.util.concurrent.TimeUnit;
+import org.openjdk.jmh.annotations.Benchmark;
+import org.openjdk.jmh.annotations.BenchmarkMode;
+import org.openjdk.jmh.annotations.Fork;
+import org.openjdk.jmh.annotations.Measurement;
+import org.openjdk.jmh.annotations.Mode;
+import org.openjdk.jmh.annotations.OutputTimeUnit;
+import org.openjdk.jmh.annotations.Param;
+import org.openjdk.jmh.annotations.Scope;
+import org.openjdk.jmh.annotations.Setup;
+import org.openjdk.jmh.annotations.State;
+import org.openjdk.jmh.annotations.Warmup;
+import org.openjdk.jmh.profile.GCProfiler;
+import org.openjdk.jmh.runner.Runner;
+import org.openjdk.jmh.runner.options.OptionsBuilder;
+
+/**
+ * JMH benchmarks of the hot paths of Box.java.
+ * They run headless: Console writes into memory instead of the terminal.
+ *
+ * Compile together with Box.java against jmh-core, jmh-generator-annprocess and jna,
+ * then run this class; it reports ns/op and, through the GC profiler, the allocation rate.
+ */
+@BenchmarkMode(Mode.AverageTime)
+@OutputTimeUnit(TimeUnit.NANOSECONDS)
+@Warmup(iterations = 3, time = 1)
+@Measurement(iterations = 5, time = 1)
+@Fork(1)
+public class BoxBenchmark {
+
+    @State(Scope.Thread)
+    public static class Keys {
+        final byte[][] inputs = {
+            {'a', 0, 0, 0, 0, 0, 0, 0},
+            {'Z', 0, 0, 0, 0, 0, 0, 0},
+            {0x0d, 0, 0, 0, 0, 0, 0, 0},
+            {0x7f, 0, 0, 0, 0, 0, 0, 0},
+            {0x1b, '[', 'A', 0, 0, 0, 0, 0},
+            {0x1b, 'O', 'P', 0, 0, 0, 0, 0},
+            {0x1b, '[', '2', '4', '~', 0, 0, 0},
+            {0x1b, '[', '9', '9', '~', 0, 0, 0}, // unsupported
+        };
+        int i = 0;
+    }
+
+    @State(Scope.Thread)
+    public static class Screen {
+        @Param({"80x25", "160x50", "240x80", "400x120"})
+        public String size;
+
+        Layer layer;
+        Layer overlay;
+        Compositor compositor;
+        ByteArrayOutputStream sink = new ByteArrayOutputStream();
+        int i = 0;
+
+        @Setup
+        public void setup() {
+            String[] dimensions = size.split("x");
+            layer = new Layer(Integer.parseInt(dimensions[0]), Integer.parseInt(dimensions[1]));
+            overlay = new Layer(layer.width, layer.height);
+            compositor = new Compositor(overlay, layer);
+            Console.out = sink;
+            compositor.compose();
+            Console.render(compositor);
+        }
+    }
+
+    @State(Scope.Thread)
+    public static class Editor {
+        @Param({"80x25", "400x120"})
+        public String size;
+
+        @Param({"1", "256"})
+        public int effects;
+
+        TextEditor editor;
+        long now = 0L;
+
+        @Setup
+        public void setup() {
+            String[] dimensions = size.split("x");
+            editor = new TextEditor(Integer.parseInt(dimensions[0]), Integer.parseInt(dimensions[1]));
+            editor.clock.schedule(editor.cursor, now);
+            for (int i = 1; i < effects; i++) {
+                int column = FastRandom.nextInt(editor.layer.width);
+                int row = FastRandom.nextInt(editor.layer.height);
+                editor.clock.schedule(new ChaoticCharacter(column, row, Integer.MAX_VALUE), now);
+            }
+        }
+    }
+
+    @Benchmark
+    public Ascii asciiFrom(Keys keys) {
+        return Ascii.from(keys.inputs[keys.i++ & 7]);
+    }
+
+    @Benchmark
+    public void layerPut(Screen screen) {
+        int i = screen.i++;
+        screen.layer.put(i % screen.layer.width, (i / screen.layer.width) % screen.layer.height, 'x');
+    }
+
+    /// Typing one character and erasing it again, as the overlay does with its effects.
+    @Benchmark
+    public void layerErase(Screen screen) {
+        int i = screen.i++;
+        screen.overlay.put(i % screen.overlay.width, (i / screen.overlay.width) % screen.overlay.height, 'x').erase();
+    }
+
+    /// The common frame: one cell has changed.
+    @Benchmark
+    public int renderOneCell(Screen screen) {
+        int i = screen.i++;
+        screen.layer.put(i % screen.layer.width, (i / screen.layer.width) % screen.layer.height, 'a' + (i & 15));
+        screen.compositor.compose();
+        Console.render(screen.compositor);
+        int bytes = screen.sink.size();
+        screen.sink.reset();
+        return bytes;
+    }
+
+    /// The worst frame: every cell has changed, half of them with colors.
+    @Benchmark
+    public int renderFullFrame(Screen screen) {
+        int i = screen.i++;
+        long[] buffer = screen.layer.buffer;
+        for (int cell = 0; cell < buffer.length; cell++) {
+            buffer[cell] = (cell & 1) == 0 ? 'a' + (i & 15) : Cell.of('b' + (i & 15), 2 + (i & 3), Cell.DEFAULT, Cell.BOLD);
+        }
+        Arrays.fill(screen.layer.dirtyRows, -1L);
+        screen.compositor.compose();
+        Console.render(screen.compositor);
+        int bytes = screen.sink.size();
+        screen.sink.reset();
+        return bytes;
+    }
+
+    @Benchmark
+    public void applyEffects(Editor editor) {
+        editor.now += FrameClock.TICK; // every effect is due
+        editor.editor.applyEffects(editor.now);
+    }
+
+    public static void main(String... args) throws Exception {
+        new Runner(new OptionsBuilder()
+            .include(BoxBenchmark.class.getSimpleName())
+            .addProfiler(GCProfiler.class)
+            .build()).run();
+    }
+}
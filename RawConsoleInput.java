@@ -25,6 +25,8 @@ import java.util.List;
 import com.sun.jna.LastErrorException;
 import com.sun.jna.Library;
 import com.sun.jna.Native;
+import com.sun.jna.NativeLong;
+import com.sun.jna.Platform;
 import com.sun.jna.Structure;
 import com.sun.jna.Pointer;
 import com.sun.jna.ptr.IntByReference;
@@ -62,6 +64,77 @@ public static int read (boolean wait) throws IOException {
     else {
       return readUnix(wait); }}
 
+/**
+* Reads a character from the console without echo, waiting at most the given time.
+*
+* <p>On Unix the wait is done by poll(), no CPU is used while waiting.
+*
+* @param timeoutMillis
+*   Maximum time to wait for a character, in milliseconds.
+* @return
+*   -2 if no character is available within the timeout.
+*   -1 on EOF.
+*   Otherwise an Unicode character code within the range 0 to 0xFFFF.
+*/
+public static int read (long timeoutMillis) throws IOException {
+   if (isWindows) {
+      return readWindows(timeoutMillis); }
+    else {
+      return readUnix(timeoutMillis); }}
+
+/**
+* Reads all the characters that are available from the console without echo.
+*
+* <p>The bytes are decoded in one pass, with a fast path for pure ASCII input.
+* Unlike read(boolean), no global lock is taken; each thread has its own decoder.
+* An incomplete multi-byte character at the end of the input is kept for the next call.
+*
+* @param codePoints
+*   Receives the Unicode code points (on Windows the character codes as with read(boolean)).
+*   Must have room for at least 4 elements.
+* @param wait
+*   <code>true</code> to wait until at least one character is available,
+*   <code>false</code> to return immediately if no character is available.
+* @return
+*   The number of code points stored, 0 if <code>wait</code> is <code>false</code> and no character is available.
+*   -1 on EOF.
+*/
+public static int read (int[] codePoints, boolean wait) throws IOException {
+   if (codePoints.length < 4) {
+      throw new IllegalArgumentException("Room for at least 4 code points is needed."); }
+   if (isWindows) {
+      return readWindows(codePoints, wait); }
+    else {
+      return readUnix(codePoints, wait); }}
+
+/**
+* Switches the console to raw mode: no echo, no line editing, no signal keys
+* and no input or output processing.
+*
+* <p>Unlike read(), which alters the console mode around each single read,
+* this method leaves the console in raw mode until resetConsoleMode() is called.
+* No external program (stty) is involved, the mode is switched synchronously.
+*/
+public static void setRawMode() throws IOException {
+   if (isWindows) {
+      setRawModeWindows(); }
+    else {
+      setRawModeUnix(); }}
+
+/**
+* Returns the size of the console window.
+*
+* @return
+*   <code>{columns, rows}</code>, or <code>null</code> if the size cannot be determined
+*   (STDOUT is not a console, Windows, where this is not implemented,
+*   or a Unix other than Linux, macOS and the BSDs, whose TIOCGWINSZ number is not known here).
+*/
+public static int[] getConsoleSize() throws IOException {
+   if (isWindows) {
+      return null; }
+    else {
+      return getConsoleSizeUnix(); }}
+
 /**
 * Resets console mode to normal line mode with echo.
 *
@@ -76,6 +149,52 @@ public static void resetConsoleMode() throws IOException {
     else {
       resetConsoleModeUnix(); }}
 
+/**
+* Receives the console input read by the listener thread.
+*/
+public static interface InputListener {
+   /**
+   * Called on the listener thread for each batch of characters, see read(int[], boolean).
+   * The array is reused for the next batch.
+   * <code>count</code> is -1 on EOF, the listener thread ends then.
+   */
+   void input (int[] codePoints, int count); }
+
+/**
+* Starts a daemon thread that waits for console input and passes it to the listener.
+*
+* <p>On Unix the thread sleeps in poll() until input arrives,
+* so the caller gets the keys with low latency and without polling on its own.
+* Only one listener can be active at once.
+*/
+public static synchronized void startListener (InputListener listener) throws IOException {
+   if (listenerThread != null) {
+      throw new IllegalStateException("A listener is already active."); }
+   if (!isWindows) {
+      initUnix();
+      openWakeupPipe(); }
+   listenerStopped = false;
+   listenerThread = new Thread(() -> runListener(listener), "RawConsoleInput listener");
+   listenerThread.setDaemon(true);
+   listenerThread.start(); }
+
+/**
+* Stops the listener thread started by startListener() and waits for it to end.
+*
+* <p>On Windows the thread only notices when the next key is pressed; this method does not wait for it there.
+*/
+public static synchronized void stopListener() throws IOException {
+   if (listenerThread == null) {
+      return; }
+   listenerStopped = true;
+   if (!isWindows) {
+      wakeUpListener();
+      try {
+         listenerThread.join(); }
+       catch (InterruptedException e) {
+         Thread.currentThread().interrupt(); }}
+   listenerThread = null; }
+
 private static void registerShutdownHook() {
    Runtime.getRuntime().addShutdownHook( new Thread() {
       public void run() {
@@ -86,6 +205,49 @@ private static void shutdownHook() {
       resetConsoleMode(); }
     catch (Exception e) {}}
 
+//--- Listener -----------------------------------------------------------------
+
+private static Thread                  listenerThread;
+private static volatile boolean        listenerStopped;
+
+private static void runListener (InputListener listener) {
+   int[] codePoints = new int[256];
+   try {
+      if (isWindows) {
+         runListenerWindows(listener, codePoints); }
+       else {
+         runListenerUnix(listener, codePoints); }}
+    catch (IOException e) {
+      listener.input(codePoints, -1); }}
+
+private static void runListenerWindows (InputListener listener, int[] codePoints) throws IOException {
+   while (!listenerStopped) {
+      int count = readWindows(codePoints, true);           // Windows has no poll(), it blocks in the read
+      if (listenerStopped) {
+         return; }
+      listener.input(codePoints, count);
+      if (count == -1) {
+         return; }}}
+
+// The console stays in raw mode while the listener runs, so that poll() sees every key stroke.
+private static void runListenerUnix (InputListener listener, int[] codePoints) throws IOException {
+   BulkDecoder decoder = bulkDecoder.get();
+   if (stdinIsConsole) {
+      consoleModeAltered = true;
+      setTerminalAttrs(stdinFd, rawTermios); }
+   try {
+      while (!listenerStopped) {
+         if (System.in.available() == 0 && !waitForInput(-1)) {  // woken up by stopListener()
+            continue; }
+         int count = decoder.read(System.in, codePoints, true);  // poll() said readable: only a blocking read reports EOF
+         if (count != 0) {
+            listener.input(codePoints, count); }
+         if (count == -1) {
+            return; }}}
+    finally {
+      if (stdinIsConsole) {
+         setTerminalAttrs(stdinFd, intermediateTermios); }}}
+
 //--- Windows ------------------------------------------------------------------
 
 // The Windows version uses _kbhit() and _getwch() from msvcrt.dll.
@@ -110,6 +272,30 @@ private static int readWindows (boolean wait) throws IOException {
       return -2; }                                         // no key available
    return getwch(); }
 
+// Windows has no poll() for the console, so _kbhit() is checked every millisecond.
+private static int readWindows (long timeoutMillis) throws IOException {
+   long deadline = System.currentTimeMillis() + timeoutMillis;
+   while (true) {
+      int c = readWindows(false);
+      if (c != -2 || System.currentTimeMillis() >= deadline) {
+         return c; }
+      try {
+         Thread.sleep(1); }
+       catch (InterruptedException e) {
+         Thread.currentThread().interrupt();
+         return -2; }}}
+
+private static int readWindows (int[] codePoints, boolean wait) throws IOException {
+   int n = 0;
+   while (n < codePoints.length) {
+      int c = readWindows(wait && n == 0);
+      if (c == -2) {                                       // no more keys available
+         break; }
+      if (c == -1) {                                       // EOF
+         return n == 0 ? -1 : n; }
+      codePoints[n++] = c; }
+   return n; }
+
 private static int getwch() {
    int c = msvcrt._getwch();
    if (c == 0 || c == 0xE0) {                              // Function key or arrow key
@@ -154,6 +340,13 @@ private static void setConsoleMode (Pointer handle, int mode) throws IOException
    if (rc == 0) {
       throw new IOException("SetConsoleMode() failed."); }}
 
+private static void setRawModeWindows() throws IOException {
+   initWindows();
+   if (!stdinIsConsole) {
+      return; }
+   consoleModeAltered = true;
+   setConsoleMode(consoleHandle, originalConsoleMode & ~(Kernel32Defs.ENABLE_PROCESSED_INPUT | Kernel32Defs.ENABLE_LINE_INPUT | Kernel32Defs.ENABLE_ECHO_INPUT)); }
+
 private static void resetConsoleModeWindows() throws IOException {
    if (!initDone || !stdinIsConsole || !consoleModeAltered) {
       return; }
@@ -186,11 +379,15 @@ private static interface Kernel32 extends Library {
 // A CharsetDecoder is used to convert bytes to characters.
 
 private static final int               stdinFd = 0;
+private static final int               stdoutFd = 1;
 private static Libc                    libc;
 private static CharsetDecoder          charsetDecoder;
 private static Termios                 originalTermios;
 private static Termios                 rawTermios;
 private static Termios                 intermediateTermios;
+private static boolean                 asciiCompatible;    // the charset decodes bytes 0..127 to the same characters
+private static final ThreadLocal<BulkDecoder> bulkDecoder = ThreadLocal.withInitial(BulkDecoder::new);
+private static int[]                   wakeupPipe;         // [read end, write end], interrupts the listener's poll()
 
 private static int readUnix (boolean wait) throws IOException {
    initUnix();
@@ -205,6 +402,76 @@ private static int readUnix (boolean wait) throws IOException {
     finally {
       setTerminalAttrs(stdinFd, intermediateTermios); }}   // reset some console attributes
 
+private static int readUnix (long timeoutMillis) throws IOException {
+   initUnix();
+   if (!stdinIsConsole) {
+      if (System.in.available() == 0 && !waitForInput(timeoutMillis)) {
+         return -2; }
+      return readSingleCharFromByteStream(System.in); }
+   consoleModeAltered = true;
+   setTerminalAttrs(stdinFd, rawTermios);                  // switch off canonical mode, echo and signals
+   try {
+      if (System.in.available() == 0 && !waitForInput(timeoutMillis)) {
+         return -2; }                                      // nothing within the timeout
+      return readSingleCharFromByteStream(System.in); }
+    finally {
+      setTerminalAttrs(stdinFd, intermediateTermios); }}   // reset some console attributes
+
+// Waits until STDIN is readable. A negative timeout waits forever.
+// Returns false on timeout or when the listener is woken up through the wakeup pipe.
+private static boolean waitForInput (long timeoutMillis) throws IOException {
+   Pollfd[] fds = (Pollfd[])new Pollfd().toArray(wakeupPipe == null ? 1 : 2);
+   fds[0].fd = stdinFd;
+   fds[0].events = LibcDefs.POLLIN;
+   if (wakeupPipe != null) {
+      fds[1].fd = wakeupPipe[0];
+      fds[1].events = LibcDefs.POLLIN; }
+   long deadline = System.currentTimeMillis() + timeoutMillis;
+   while (true) {
+      int timeout = timeoutMillis < 0 ? -1 : (int)Math.max(0, Math.min(Integer.MAX_VALUE, deadline - System.currentTimeMillis()));
+      try {
+         int rc = libc.poll(fds, fds.length, timeout);
+         if (rc == 0) {
+            return false; }                                // timeout
+         break; }
+       catch (LastErrorException e) {
+         if (e.getErrorCode() != LibcDefs.EINTR) {
+            throw new IOException("poll() failed.", e); }}}
+   for (Pollfd fd : fds) {
+      fd.read(); }
+   if (fds.length > 1 && fds[1].revents != 0) {
+      libc.read(wakeupPipe[0], new byte[16], new NativeLong(16));  // drain the wakeups
+      return false; }
+   return fds[0].revents != 0; }
+
+private static synchronized void openWakeupPipe() throws IOException {
+   if (wakeupPipe != null) {
+      return; }
+   int[] fds = new int[2];
+   try {
+      libc.pipe(fds); }
+    catch (LastErrorException e) {
+      throw new IOException("pipe() failed.", e); }
+   wakeupPipe = fds; }
+
+private static void wakeUpListener() throws IOException {
+   try {
+      libc.write(wakeupPipe[1], new byte[] {1}, new NativeLong(1)); }
+    catch (LastErrorException e) {
+      throw new IOException("write() failed.", e); }}
+
+private static int readUnix (int[] codePoints, boolean wait) throws IOException {
+   initUnix();
+   BulkDecoder decoder = bulkDecoder.get();
+   if (!stdinIsConsole) {                                  // STDIN is not a console
+      return decoder.read(System.in, codePoints, wait); }
+   consoleModeAltered = true;
+   setTerminalAttrs(stdinFd, rawTermios);                  // switch off canonical mode, echo and signals
+   try {
+      return decoder.read(System.in, codePoints, wait); }
+    finally {
+      setTerminalAttrs(stdinFd, intermediateTermios); }}   // reset some console attributes
+
 private static Termios getTerminalAttrs (int fd) throws IOException {
    Termios termios = new Termios();
    try {
@@ -249,12 +516,74 @@ private static synchronized int decodeCharFromBytes (byte[] inBytes, int inLen)
       return -1; }
    return out.get(0); }
 
+// Decodes whole reads at once. One instance per thread, so no locking is needed.
+private static class BulkDecoder {
+   final CharsetDecoder decoder;
+   byte[]               bytes = new byte[0];
+   CharBuffer           chars = CharBuffer.allocate(0);
+   int                  carryLen;                          // bytes of an incomplete character from the previous read
+   BulkDecoder() {
+      decoder = Charset.defaultCharset().newDecoder();
+      decoder.onMalformedInput(CodingErrorAction.REPLACE);
+      decoder.onUnmappableCharacter(CodingErrorAction.REPLACE);
+      decoder.replaceWith(invalidKeyStr); }
+   int read (InputStream inputStream, int[] codePoints, boolean wait) throws IOException {
+      if (bytes.length < codePoints.length) {
+         bytes = Arrays.copyOf(bytes, codePoints.length);
+         chars = CharBuffer.allocate(codePoints.length); }
+      int n = 0;
+      while (n == 0) {
+         int available = inputStream.available();
+         if (available == 0 && !wait) {
+            return 0; }                                    // no input available
+         int room = codePoints.length - carryLen;          // each byte yields at most one code point
+         int len = inputStream.read(bytes, carryLen, Math.max(1, Math.min(available, room)));
+         if (len == -1) {                                  // EOF
+            return -1; }
+         n = decode(carryLen + len, codePoints); }
+      return n; }
+   int decode (int len, int[] codePoints) {
+      int n = 0;
+      int i = 0;
+      if (asciiCompatible) {
+         while (i < len && bytes[i] >= 0) {                // ASCII fast path
+            codePoints[n++] = bytes[i++]; }
+         if (i == len) {
+            carryLen = 0;
+            return n; }}
+      ByteBuffer in = ByteBuffer.wrap(bytes, i, len - i);
+      chars.clear();
+      decoder.decode(in, chars, false);
+      chars.flip();
+      while (chars.hasRemaining()) {
+         char c = chars.get();
+         if (Character.isHighSurrogate(c) && chars.hasRemaining() && Character.isLowSurrogate(chars.get(chars.position()))) {
+            codePoints[n++] = Character.toCodePoint(c, chars.get()); }
+          else {
+            codePoints[n++] = c; }}
+      carryLen = in.remaining();
+      System.arraycopy(bytes, in.position(), bytes, 0, carryLen);
+      return n; }}
+
+private static boolean isAsciiCompatible (Charset charset) {
+   byte[] ascii = new byte[128];
+   for (int i = 0; i < ascii.length; i++) {
+      ascii[i] = (byte)i; }
+   String decoded = new String(ascii, charset);
+   if (decoded.length() != ascii.length) {
+      return false; }
+   for (int i = 0; i < ascii.length; i++) {
+      if (decoded.charAt(i) != i) {
+         return false; }}
+   return true; }
+
 private static synchronized void initUnix() throws IOException {
    if (initDone) {
       return; }
    libc = Native.load("c", Libc.class);
    stdinIsConsole = libc.isatty(stdinFd) == 1;
    charsetDecoder = Charset.defaultCharset().newDecoder();
+   asciiCompatible = isAsciiCompatible(Charset.defaultCharset());
    if (stdinIsConsole) {
       originalTermios = getTerminalAttrs(stdinFd);
       rawTermios = new Termios(originalTermios);
@@ -265,6 +594,28 @@ private static synchronized void initUnix() throws IOException {
       registerShutdownHook(); }
    initDone = true; }
 
+private static void setRawModeUnix() throws IOException {
+   initUnix();
+   if (!stdinIsConsole) {
+      return; }
+   Termios termios = new Termios(originalTermios);
+   libc.cfmakeraw(termios);                                // same as "stty raw -echo"
+   consoleModeAltered = true;
+   setTerminalAttrs(stdinFd, termios); }
+
+private static int[] getConsoleSizeUnix() throws IOException {
+   initUnix();
+   if (LibcDefs.TIOCGWINSZ == 0) {
+      return null; }
+   Winsize winsize = new Winsize();
+   try {
+      int rc = libc.ioctl(stdoutFd, new NativeLong(LibcDefs.TIOCGWINSZ), winsize);
+      if (rc != 0 || winsize.ws_col <= 0 || winsize.ws_row <= 0) {
+         return null; }}
+    catch (LastErrorException e) {
+      return null; }
+   return new int[] {winsize.ws_col, winsize.ws_row}; }
+
 private static void resetConsoleModeUnix() throws IOException {
    if (!initDone || !stdinIsConsole || !consoleModeAltered) {
       return; }
@@ -289,19 +640,55 @@ protected static class Termios extends Structure {         // termios.h
       c_line  = t.c_line;
       filler  = t.filler.clone(); }}
 
+protected static class Winsize extends Structure {         // sys/ioctl.h
+   public short    ws_row;
+   public short    ws_col;
+   public short    ws_xpixel;
+   public short    ws_ypixel;
+   @Override protected List<String> getFieldOrder() {
+      return Arrays.asList("ws_row", "ws_col", "ws_xpixel", "ws_ypixel"); }}
+
+protected static class Pollfd extends Structure {          // poll.h
+   public int      fd;
+   public short    events;
+   public short    revents;
+   @Override protected List<String> getFieldOrder() {
+      return Arrays.asList("fd", "events", "revents"); }
+   public Pollfd() {}}                                     // toArray() needs a public constructor
+
 private static class LibcDefs {
    // termios.h
    static final int ISIG    = 0000001;
    static final int ICANON  = 0000002;
    static final int ECHO    = 0000010;
    static final int ECHONL  = 0000100;
-   static final int TCSANOW = 0; }
+   static final int TCSANOW = 0;
+   // sys/ioctl.h, differs between systems, 0 if unknown
+   static final long TIOCGWINSZ = tiocgwinsz();
+   // poll.h
+   static final short POLLIN = 0x0001;
+   // errno.h
+   static final int EINTR   = 4;
+   private static long tiocgwinsz() {
+      if (Platform.isLinux()) {
+         return Platform.isPPC() || Platform.isMIPS() || Platform.isSPARC() ? 0x40087468 : 0x5413; }
+      if (Platform.isMac() || Platform.isFreeBSD() || Platform.isOpenBSD() || Platform.isNetBSD()) {
+         return 0x40087468; }                              // _IOR('t', 104, struct winsize)
+      return 0; }}
 
 private static interface Libc extends Library {
    // termios.h
    int tcgetattr (int fd, Termios termios) throws LastErrorException;
    int tcsetattr (int fd, int opt, Termios termios) throws LastErrorException;
+   void cfmakeraw (Termios termios);
+   // sys/ioctl.h
+   int ioctl (int fd, NativeLong request, Winsize winsize) throws LastErrorException;
+   // poll.h
+   int poll (Pollfd[] fds, int nfds, int timeout) throws LastErrorException;
    // unistd.h
-   int isatty (int fd); }
+   int isatty (int fd);
+   int pipe (int[] fds) throws LastErrorException;
+   NativeLong read (int fd, byte[] buf, NativeLong count) throws LastErrorException;
+   NativeLong write (int fd, byte[] buf, NativeLong count) throws LastErrorException; }
 
 }
\ No newline at end of file
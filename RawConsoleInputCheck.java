@@ -0,0 +1,26 @@
+package biz.source_code.utils;
+
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Checks that the input listener ends with count -1 when stdin reaches EOF.
+ *
+ * Compile together with RawConsoleInput.java against jna, then run with stdin closed:
+ * <pre>echo -n | java biz.source_code.utils.RawConsoleInputCheck</pre>
+ * It exits with status 0 if the listener reported EOF, 1 if it did not within five seconds.
+ */
+public class RawConsoleInputCheck {
+
+    public static void main(String... args) throws Exception {
+        CountDownLatch eof = new CountDownLatch(1);
+        RawConsoleInput.startListener((codePoints, count) -> {
+            if (count == -1) {
+                eof.countDown();
+            }
+        });
+        boolean ended = eof.await(5, TimeUnit.SECONDS);
+        System.out.println(ended ? "listener ended with -1 on EOF" : "listener did not report EOF");
+        System.exit(ended ? 0 : 1);
+    }
+}
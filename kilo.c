@@ -1,12 +1,30 @@
+#define _GNU_SOURCE // posix_openpt and friends
+
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <termios.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <string.h>
 #include <time.h>
 
+#if defined(__linux__) && !defined(KILO_NO_IO_URING)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
 #define CONTROL(key) ((key) & 0x1f)
 #define SHIFT(key) ((key) & 0x40)
 #define ESC "\x1b"
@@ -55,15 +73,239 @@ void backBufferClear() {
 }
 
 void backBufferAppend(const char *data, int length) {
+    // styled text emits an SGR per span, so a frame has no fixed upper bound
     if (backBuffer.length + length >= backBuffer.capacity) {
-        die("back buffer capacity exceeded");
+        int capacity = backBuffer.capacity;
+        while (backBuffer.length + length >= capacity) {
+            capacity *= 2;
+        }
+        char *data = realloc(backBuffer.data, capacity);
+        if (data == NULL) {
+            die("realloc");
+        }
+        backBuffer.data = data;
+        backBuffer.capacity = capacity;
     }
     memcpy(&(backBuffer.data[backBuffer.length]), data, length);
     backBuffer.length += length;
 }
 
 void backBufferRender() {
-    write(STDOUT_FILENO, backBuffer.data, backBuffer.length);
+    int written = 0;
+    while (written < backBuffer.length) {
+        ssize_t n = write(STDOUT_FILENO, &backBuffer.data[written], backBuffer.length - written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+}
+
+/** CLIPBOARD ****************************************************************/
+
+/*
+ * Copies to the system clipboard with OSC 52, which the terminal handles,
+ * so it also works over SSH without any external tool.
+ * The text is base64-encoded as it streams through a fixed-size chunk,
+ * so even a huge selection never exists as one encoded string.
+ * Full chunks wait in a short queue that the main loop drains whenever the
+ * terminal can take more, so input is handled while a copy goes out. No
+ * frame may be drawn until the queue is empty, as it would land inside the
+ * sequence.
+ */
+
+#define CLIPBOARD_CHUNK (64 * 1024) // multiple of 4, so chunks end on base64 quantum boundaries
+#define CLIPBOARD_QUEUE 4 // chunks waiting for the terminal before the copy stops encoding more
+
+struct ClipboardChunk {
+    char *data;
+    int length;
+    struct ClipboardChunk *next;
+};
+
+struct ClipboardQueue {
+    struct ClipboardChunk *head;
+    struct ClipboardChunk *tail;
+    int count;
+    int written; // of the head chunk
+    int open;    // a sequence was begun and its end is not written yet
+    int sent;    // some of the open sequence reached the terminal
+} clipboard;
+
+struct Base64Stream {
+    unsigned char carry[3]; // bytes of an incomplete 3-byte group
+    int carryLength;
+    char chunk[CLIPBOARD_CHUNK];
+    int length;
+} base64Stream;
+
+char base64Pairs[4096][2]; // every 12-bit value as two base64 characters, so a 3-byte group takes two lookups
+
+void writeAll(const char *data, int length) {
+    while (length > 0) {
+        int n = write(STDOUT_FILENO, data, length);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            die("write");
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+void base64Init() {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 4096; i++) {
+        base64Pairs[i][0] = alphabet[i >> 6];
+        base64Pairs[i][1] = alphabet[i & 0x3f];
+    }
+    base64Stream.carryLength = 0;
+    base64Stream.length = 0;
+}
+
+void clipboardQueue(const char *data, int length) {
+    struct ClipboardChunk *chunk = malloc(sizeof(struct ClipboardChunk));
+    chunk->data = malloc(length);
+    memcpy(chunk->data, data, length);
+    chunk->length = length;
+    chunk->next = NULL;
+    if (clipboard.tail != NULL) {
+        clipboard.tail->next = chunk;
+    } else {
+        clipboard.head = chunk;
+    }
+    clipboard.tail = chunk;
+    clipboard.count++;
+}
+
+int clipboardPending() {
+    return clipboard.head != NULL;
+}
+
+int clipboardFull() {
+    return clipboard.count >= CLIPBOARD_QUEUE;
+}
+
+/* Writes queued chunks until the terminal would block or the queue is empty. */
+void clipboardDrain() {
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK); // only while draining: stdin shares the flag
+    while (clipboard.head != NULL) {
+        struct ClipboardChunk *chunk = clipboard.head;
+        int n = write(STDOUT_FILENO, &chunk->data[clipboard.written], chunk->length - clipboard.written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            fcntl(STDOUT_FILENO, F_SETFL, flags);
+            die("write");
+        }
+        clipboard.sent = 1;
+        clipboard.written += n;
+        if (clipboard.written == chunk->length) {
+            clipboard.head = chunk->next;
+            if (clipboard.head == NULL) {
+                clipboard.tail = NULL;
+            }
+            clipboard.count--;
+            clipboard.written = 0;
+            free(chunk->data);
+            free(chunk);
+        }
+    }
+    fcntl(STDOUT_FILENO, F_SETFL, flags);
+}
+
+void base64Flush() {
+    if (base64Stream.length > 0) {
+        clipboardQueue(base64Stream.chunk, base64Stream.length);
+    }
+    base64Stream.length = 0;
+}
+
+void base64Group(unsigned int group) {
+    if (base64Stream.length + 4 > CLIPBOARD_CHUNK) {
+        base64Flush();
+    }
+    char *out = &base64Stream.chunk[base64Stream.length];
+    memcpy(out, base64Pairs[group >> 12], 2);
+    memcpy(out + 2, base64Pairs[group & 0xfff], 2);
+    base64Stream.length += 4;
+}
+
+void base64Feed(const char *data, int length) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    while (base64Stream.carryLength > 0 && base64Stream.carryLength < 3 && length > 0) {
+        base64Stream.carry[base64Stream.carryLength++] = *bytes++;
+        length--;
+    }
+    if (base64Stream.carryLength > 0) {
+        if (base64Stream.carryLength < 3) {
+            return; // still incomplete, all data went into the carry
+        }
+        base64Group(base64Stream.carry[0] << 16 | base64Stream.carry[1] << 8 | base64Stream.carry[2]);
+        base64Stream.carryLength = 0;
+    }
+    while (length >= 3) {
+        base64Group(bytes[0] << 16 | bytes[1] << 8 | bytes[2]);
+        bytes += 3;
+        length -= 3;
+    }
+    memcpy(base64Stream.carry, bytes, length);
+    base64Stream.carryLength = length;
+}
+
+void base64Finish() {
+    if (base64Stream.carryLength > 0) {
+        unsigned char *carry = base64Stream.carry;
+        unsigned int group = carry[0] << 16 | (base64Stream.carryLength > 1 ? carry[1] << 8 : 0);
+        base64Group(group);
+        char *end = &base64Stream.chunk[base64Stream.length];
+        end[-1] = '=';
+        if (base64Stream.carryLength == 1) {
+            end[-2] = '=';
+        }
+        base64Stream.carryLength = 0;
+    }
+    base64Flush();
+}
+
+void clipboardBegin() {
+    base64Init();
+    clipboard.open = 1;
+    clipboard.sent = 0;
+    clipboardQueue(ESC "]52;c;", 7);
+}
+
+void clipboardEnd() {
+    base64Finish();
+    clipboardQueue("\a", 1);
+    clipboard.open = 0;
+}
+
+/* Drops what is still queued, ending a sequence the terminal has begun, so that it reads what comes next. */
+void clipboardAbort() {
+    while (clipboard.head != NULL) {
+        struct ClipboardChunk *chunk = clipboard.head;
+        clipboard.head = chunk->next;
+        free(chunk->data);
+        free(chunk);
+    }
+    clipboard.tail = NULL;
+    clipboard.count = 0;
+    if (clipboard.sent && (clipboard.open || clipboard.written > 0)) {
+        writeAll("\a", 1);
+    }
+    clipboard.written = 0;
+    clipboard.open = 0;
 }
 
 /** TERMINAL *****************************************************************/
@@ -122,6 +364,16 @@ void terminalClearLine() {
     write(STDOUT_FILENO, ESC "[K", 3);
 }
 
+void terminalMouseOff() {
+    write(STDOUT_FILENO, ESC "[?1002l" ESC "[?1006l", 16);
+}
+
+void terminalMouseOn() {
+    // 1002 = report presses, releases and motion while a button is held; 1006 = SGR encoding
+    write(STDOUT_FILENO, ESC "[?1002h" ESC "[?1006h", 16);
+    atexit(terminalMouseOff);
+}
+
 void terminalGetSize(int *rows, int *columns) {
     struct winsize size;
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) >= 0 && size.ws_col > 0) {
@@ -144,11 +396,603 @@ void terminalGetSize(int *rows, int *columns) {
     }
 }
 
+/** PAGE CACHE ***************************************************************/
+
+/*
+ * Reading or writing a huge file once should not push the pages of everything
+ * else on the machine out of the page cache. How hard the editor tries to stay
+ * out of the cache depends on the size of the file.
+ */
+
+#define CACHE_DROP_BEHIND_MIN (256LL << 20) // from this size on, pages are dropped once used
+#define CACHE_DIRECT_MIN (4LL << 30)        // from this size on, reads bypass the cache
+#define CACHE_WINDOW (64LL << 20)           // written output is flushed and dropped this much at a time
+
+enum CachePolicy {
+    CACHE_NORMAL,
+    CACHE_DROP_BEHIND,
+    CACHE_DIRECT
+};
+
+int cachePolicy(long long size) {
+    if (size >= CACHE_DIRECT_MIN) {
+        return CACHE_DIRECT;
+    }
+    return size >= CACHE_DROP_BEHIND_MIN ? CACHE_DROP_BEHIND : CACHE_NORMAL;
+}
+
+/* Drops the cached pages of a range that is not going to be read again soon. */
+void cacheRelease(int fd, long long offset, long long length) {
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+/** ASYNC I/O ****************************************************************/
+
+/*
+ * A minimal io_uring, set up with the raw system calls, to keep several large
+ * reads or writes in flight while the previous chunk is being worked on.
+ * ringInit fails where the kernel (or the build, with KILO_NO_IO_URING) has no
+ * io_uring, and callers then do the same I/O with plain pread and pwrite.
+ * If the ring fails later on, the kernel may still be working on what was
+ * queued, so its buffers are only touched again once ringDestroy has seen
+ * every queued request complete.
+ */
+
+#define IO_CHUNK (1024 * 1024) // a multiple of any logical block size, for O_DIRECT
+#define IO_DEPTH 4             // chunks in flight
+
+struct Ring {
+    int fd;
+#ifdef HAVE_IO_URING
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq, *cq;
+    size_t sqSize, cqSize, sqesSize;
+    unsigned unsubmitted;
+    unsigned inFlight; // queued and not yet completed
+#endif
+};
+
+int ringInit(struct Ring *ring, unsigned entries) {
+    ring->fd = -1;
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) {
+        return -1;
+    }
+    ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqSize = ring->cqSize = ring->sqSize > ring->cqSize ? ring->sqSize : ring->cqSize;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq
+        : mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->sqTail = (unsigned *) ((char *) ring->sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) ((char *) ring->sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) ((char *) ring->sq + params.sq_off.array);
+    ring->cqHead = (unsigned *) ((char *) ring->cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) ((char *) ring->cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) ((char *) ring->cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq + params.cq_off.cqes);
+    ring->unsubmitted = ring->inFlight = 0;
+    ring->fd = fd;
+    return 0;
+#else
+    (void) entries;
+    return -1;
+#endif
+}
+
+/*
+ * Waits for everything queued to complete, then lets go of the ring. Returns
+ * -1 if that cannot be done: the kernel may then still use the buffers of the
+ * requests, so the ring is dropped without being closed and the buffers must
+ * not be reused or freed.
+ */
+int ringDestroy(struct Ring *ring) {
+    if (ring->fd == -1) {
+        return 0;
+    }
+#ifdef HAVE_IO_URING
+    while (ring->inFlight > 0) {
+        unsigned head = *ring->cqHead;
+        if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            ring->inFlight--;
+            continue;
+        }
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1 && errno != EINTR) {
+            ring->fd = -1;
+            return -1;
+        }
+        if (n > 0) {
+            ring->unsubmitted -= n;
+        }
+    }
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cq != ring->sq) {
+        munmap(ring->cq, ring->cqSize);
+    }
+    munmap(ring->sq, ring->sqSize);
+    close(ring->fd);
+#endif
+    ring->fd = -1;
+    return 0;
+}
+
+/* Queues a read (write = 0) or write of length bytes at offset; tag comes back with the completion. */
+void ringQueue(struct Ring *ring, int write, int fd, void *buffer, unsigned length, long long offset, int tag) {
+#ifdef HAVE_IO_URING
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    ring->inFlight++;
+    int n = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 0, 0, NULL, 0);
+    if (n > 0) {
+        ring->unsubmitted -= n;
+    }
+#else
+    (void) ring; (void) write; (void) fd; (void) buffer; (void) length; (void) offset; (void) tag;
+#endif
+}
+
+/*
+ * Submits what is queued and waits for a completion; returns its result
+ * (bytes or -errno) and tag, or tag -1 if the ring itself failed.
+ */
+int ringWait(struct Ring *ring, int *tag) {
+    *tag = -1;
+#ifdef HAVE_IO_URING
+    while (1) {
+        unsigned head = *ring->cqHead;
+        if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            int result = cqe->res;
+            *tag = cqe->user_data;
+            __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            ring->inFlight--;
+            return result;
+        }
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1 && errno != EINTR) {
+            return -errno;
+        }
+        if (n > 0) {
+            ring->unsubmitted -= n;
+        }
+    }
+#else
+    (void) ring;
+    return -ENOSYS;
+#endif
+}
+
+/* Reads length bytes at offset, short only at the end of the file; returns the bytes read or -1. */
+long preadFully(int fd, char *buffer, long length, long long offset) {
+    long done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, &buffer[done], length - done, offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+long pwriteFully(int fd, const char *buffer, long length, long long offset) {
+    long done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, &buffer[done], length - done, offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Reads a file front to back in IO_CHUNK pieces, IO_DEPTH of them in flight.
+ * chunkReaderNext hands out the chunks in order; a chunk's buffer is reused
+ * for the read after next once the following chunk is asked for. Depending on
+ * the cache policy, chunks are dropped from the page cache once handed out,
+ * or read with O_DIRECT on a second descriptor and never cached at all.
+ */
+struct ChunkReader {
+    int fd;
+    int directFd; // O_DIRECT, -1 unless the policy is CACHE_DIRECT
+    int policy;
+    long long size;
+    struct Ring ring;
+    char *buffers[IO_DEPTH];
+    long lengths[IO_DEPTH]; // -1 while the read is in flight
+    long long next;  // offset of the next chunk to hand out
+    long long queued; // offset of the next chunk to read
+    int current;      // slot handed out last, -1 before the first
+};
+
+void chunkReaderQueue(struct ChunkReader *reader, int slot) {
+    if (reader->queued >= reader->size) {
+        return;
+    }
+    reader->lengths[slot] = -1;
+    int fd = reader->directFd != -1 ? reader->directFd : reader->fd;
+    ringQueue(&reader->ring, 0, fd, reader->buffers[slot], IO_CHUNK, reader->queued, slot);
+    reader->queued += IO_CHUNK;
+}
+
+int chunkReaderInit(struct ChunkReader *reader, int fd, const char *filename) {
+    struct stat status;
+    if (fstat(fd, &status) == -1) {
+        return -1;
+    }
+    reader->fd = fd;
+    reader->size = status.st_size;
+    reader->policy = cachePolicy(reader->size);
+    reader->directFd = -1;
+    if (reader->policy == CACHE_DIRECT) {
+        reader->directFd = open(filename, O_RDONLY | O_DIRECT);
+        if (reader->directFd == -1) {
+            reader->policy = CACHE_DROP_BEHIND; // the file system does not do O_DIRECT
+        }
+    }
+    if (reader->policy != CACHE_NORMAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    reader->next = reader->queued = 0;
+    reader->current = -1;
+    for (int slot = 0; slot < IO_DEPTH; slot++) {
+        if (posix_memalign((void **) &reader->buffers[slot], 4096, IO_CHUNK) != 0) {
+            die("posix_memalign");
+        }
+        reader->lengths[slot] = 0;
+    }
+    if (ringInit(&reader->ring, IO_DEPTH) == 0) {
+        for (int slot = 0; slot < IO_DEPTH; slot++) {
+            chunkReaderQueue(reader, slot);
+        }
+    }
+    return 0;
+}
+
+/* Next chunk of the file; returns its length, 0 at the end or -1 on an error. */
+long chunkReaderNext(struct ChunkReader *reader, char **data) {
+    if (reader->current != -1) {
+        // the caller is done with the last chunk
+        if (reader->policy == CACHE_DROP_BEHIND) {
+            cacheRelease(reader->fd, reader->next - IO_CHUNK, IO_CHUNK);
+        }
+        if (reader->ring.fd != -1) {
+            chunkReaderQueue(reader, reader->current);
+        }
+    }
+    int slot = reader->current = (reader->current + 1) % IO_DEPTH;
+    long long offset = reader->next;
+    if (offset >= reader->size) {
+        return 0; // files that grow while being read are cut at the size they had
+    }
+    long length = -1;
+    if (reader->ring.fd != -1) {
+        while (reader->lengths[slot] == -1) {
+            int tag;
+            int result = ringWait(&reader->ring, &tag);
+            if (tag == -1) {
+                if (ringDestroy(&reader->ring) == -1) {
+                    return -1; // reads may still land in any buffer
+                }
+                break; // carry on with pread
+            }
+            reader->lengths[tag] = result;
+        }
+        length = reader->lengths[slot];
+    }
+    long wanted = reader->size - offset < IO_CHUNK ? reader->size - offset : IO_CHUNK;
+    if (length < 0 && reader->directFd != -1) {
+        length = pread(reader->directFd, reader->buffers[slot], IO_CHUNK, offset); // one read, the rest would be unaligned
+    }
+    if (length < 0) {
+        length = 0; // also when the kernel does not know IORING_OP_READ: read it here instead
+    }
+    if (length < wanted) {
+        long rest = preadFully(reader->fd, &reader->buffers[slot][length], wanted - length, offset + length);
+        if (rest == -1) {
+            return -1;
+        }
+        length += rest;
+    }
+    reader->next += IO_CHUNK;
+    *data = reader->buffers[slot];
+    return length;
+}
+
+void chunkReaderDestroy(struct ChunkReader *reader) {
+    if (ringDestroy(&reader->ring) == 0) { // else reads may still land in the buffers: leak them
+        for (int slot = 0; slot < IO_DEPTH; slot++) {
+            free(reader->buffers[slot]);
+        }
+    }
+    if (reader->directFd != -1) {
+        close(reader->directFd);
+    }
+}
+
+/** ANSI COLORS **************************************************************/
+
+/*
+ * Logs often carry their own SGR color sequences. A line with escapes in it is
+ * parsed once into its text without them and the spans of text that share a
+ * style; the result is cached, keyed by the line's text in memory, until the
+ * line is freed. Only styles the editor understood are sent to the terminal,
+ * always as a full SGR of its own, so a line cannot move the cursor, change
+ * modes or leak its colors into the rest of the screen.
+ */
+
+#define STYLE_CACHE 1024 // lines, direct mapped; comfortably more than a screen
+#define STYLE_MAX_PARAMS 32
+
+#define STYLE_BOLD      0x01
+#define STYLE_DIM       0x02
+#define STYLE_ITALIC    0x04
+#define STYLE_UNDERLINE 0x08
+#define STYLE_BLINK     0x10
+#define STYLE_REVERSE   0x20
+#define STYLE_STRIKE    0x40
+#define STYLE_RGB       0x1000000 // color is 0xrrggbb rather than a palette index
+
+struct Style {
+    int flags;
+    int fg, bg; // -1 for the default color
+};
+
+struct StyleSpan {
+    int from; // byte of the text where the style starts
+    struct Style style;
+};
+
+struct StyledText {
+    const char *key; // the raw line this was parsed from, NULL if the entry is free
+    char *text;
+    int length;
+    struct StyleSpan *spans;
+    int spanCount;
+} styleCache[STYLE_CACHE];
+
+const struct StyleSpan styleDefault = { 0, { 0, -1, -1 } };
+
+/* Reads an extended color (5;n or 2;r;g;b) starting at params[*i]; returns -1 if malformed. */
+int styleColor(const int *params, int count, int *i) {
+    if (*i + 1 < count && params[*i] == 5) {
+        *i += 1;
+        return params[*i] & 0xff;
+    }
+    if (*i + 3 < count && params[*i] == 2) {
+        int color = STYLE_RGB | (params[*i + 1] & 0xff) << 16 | (params[*i + 2] & 0xff) << 8 | (params[*i + 3] & 0xff);
+        *i += 3;
+        return color;
+    }
+    return -1;
+}
+
+/* Applies the parameters of one SGR sequence to the style. */
+void styleApply(struct Style *style, const char *chars, int length) {
+    int params[STYLE_MAX_PARAMS] = { 0 };
+    int count = 1;
+    for (int i = 0; i < length; i++) {
+        if (chars[i] == ';' || chars[i] == ':') {
+            if (count == STYLE_MAX_PARAMS) {
+                break;
+            }
+            params[count++] = 0;
+        } else if (isdigit((unsigned char) chars[i])) {
+            params[count - 1] = min(params[count - 1] * 10 + (chars[i] - '0'), 65535);
+        }
+    }
+
+    static const int flags[10] = { 0, STYLE_BOLD, STYLE_DIM, STYLE_ITALIC, STYLE_UNDERLINE, STYLE_BLINK, 0, STYLE_REVERSE, 0, STYLE_STRIKE };
+    for (int i = 0; i < count; i++) {
+        int p = params[i];
+        if (p == 0) {
+            style->flags = 0;
+            style->fg = style->bg = -1;
+        } else if (p < 10) {
+            style->flags |= flags[p];
+        } else if (p == 22) {
+            style->flags &= ~(STYLE_BOLD | STYLE_DIM);
+        } else if (p >= 23 && p <= 29) {
+            style->flags &= ~flags[p - 20];
+        } else if (p >= 30 && p <= 37) {
+            style->fg = p - 30;
+        } else if (p == 38) {
+            i++;
+            style->fg = styleColor(params, count, &i);
+        } else if (p == 39) {
+            style->fg = -1;
+        } else if (p >= 40 && p <= 47) {
+            style->bg = p - 40;
+        } else if (p == 48) {
+            i++;
+            style->bg = styleColor(params, count, &i);
+        } else if (p == 49) {
+            style->bg = -1;
+        } else if (p >= 90 && p <= 97) {
+            style->fg = p - 90 + 8;
+        } else if (p >= 100 && p <= 107) {
+            style->bg = p - 100 + 8;
+        }
+    }
+}
+
+void styleAddSpan(struct StyledText *styled, int *capacity, int from, struct Style style) {
+    if (styled->spanCount > 0 && styled->spans[styled->spanCount - 1].from == from) {
+        styled->spanCount--; // nothing was printed in the previous style
+    }
+    if (styled->spanCount > 0 && memcmp(&styled->spans[styled->spanCount - 1].style, &style, sizeof(style)) == 0) {
+        return;
+    }
+    if (styled->spanCount == *capacity) {
+        *capacity *= 2;
+        styled->spans = realloc(styled->spans, *capacity * sizeof(struct StyleSpan));
+    }
+    styled->spans[styled->spanCount].from = from;
+    styled->spans[styled->spanCount].style = style;
+    styled->spanCount++;
+}
+
+void styleParse(struct StyledText *styled, const char *chars, int length) {
+    int capacity = 8;
+    styled->text = malloc(length + 1);
+    styled->length = 0;
+    styled->spans = malloc(capacity * sizeof(struct StyleSpan));
+    styled->spanCount = 0;
+    struct Style style = styleDefault.style;
+    styleAddSpan(styled, &capacity, 0, style);
+
+    int i = 0;
+    while (i < length) {
+        const char *escape = memchr(&chars[i], 0x1b, length - i);
+        int run = escape != NULL ? escape - &chars[i] : length - i;
+        memcpy(&styled->text[styled->length], &chars[i], run);
+        styled->length += run;
+        i += run;
+        if (i == length) {
+            break;
+        }
+        if (i + 1 < length && chars[i + 1] == '[') {
+            int end = i + 2;
+            while (end < length && (chars[end] < 0x40 || chars[end] > 0x7e)) {
+                end++;
+            }
+            if (end < length && chars[end] == 'm') {
+                styleApply(&style, &chars[i + 2], end - i - 2);
+                styleAddSpan(styled, &capacity, styled->length, style);
+            }
+            i = end + 1; // any other CSI sequence is dropped
+        } else if (i + 1 < length && chars[i + 1] == ']') {
+            // OSC, up to BEL or ESC backslash
+            i += 2;
+            while (i < length && chars[i] != '\a' && !(chars[i] == 0x1b && i + 1 < length && chars[i + 1] == '\\')) {
+                i++;
+            }
+            i += i < length && chars[i] == 0x1b ? 2 : 1;
+        } else {
+            i += 2;
+        }
+    }
+    styled->text[styled->length] = '\0';
+}
+
+struct StyledText *styleEntry(const char *chars) {
+    return &styleCache[((unsigned long) chars >> 4) % STYLE_CACHE];
+}
+
+/* The parsed form of a line with escapes in it, from the cache when it is there. */
+struct StyledText *styleLookup(const char *chars, int length) {
+    struct StyledText *styled = styleEntry(chars);
+    if (styled->key != chars) {
+        if (styled->key != NULL) {
+            free(styled->text);
+            free(styled->spans);
+        }
+        styleParse(styled, chars, length);
+        styled->key = chars;
+    }
+    return styled;
+}
+
+/* Drops the cached form of a line whose text is about to be freed. */
+void styleForget(const char *chars) {
+    struct StyledText *styled = styleEntry(chars);
+    if (styled->key == chars) {
+        free(styled->text);
+        free(styled->spans);
+        styled->key = NULL;
+    }
+}
+
+/* Appends a complete SGR sequence for the style, reversed if asked to. */
+void styleAppend(const struct Style *style, int reverse) {
+    static const int codes[7] = { 1, 2, 3, 4, 5, 7, 9 };
+    char sequence[64];
+    int length = snprintf(sequence, sizeof(sequence), ESC "[0");
+    int flags = style->flags ^ (reverse ? STYLE_REVERSE : 0);
+    for (int bit = 0; bit < 7; bit++) {
+        if (flags & (1 << bit)) {
+            length += snprintf(&sequence[length], sizeof(sequence) - length, ";%d", codes[bit]);
+        }
+    }
+    int colors[2] = { style->fg, style->bg };
+    for (int i = 0; i < 2; i++) {
+        int color = colors[i];
+        if (color == -1) {
+            continue;
+        } else if (color & STYLE_RGB) {
+            length += snprintf(&sequence[length], sizeof(sequence) - length, ";%d;2;%d;%d;%d",
+                i == 0 ? 38 : 48, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+        } else if (color < 16) {
+            length += snprintf(&sequence[length], sizeof(sequence) - length, ";%d", (i == 0 ? 30 : 40) + (color < 8 ? color : color - 8 + 60));
+        } else {
+            length += snprintf(&sequence[length], sizeof(sequence) - length, ";%d;5;%d", i == 0 ? 38 : 48, color);
+        }
+    }
+    sequence[length++] = 'm';
+    backBufferAppend(sequence, length);
+}
+
 /** EDITOR *******************************************************************/
 
 struct Line {
-    char *chars;
+    char *chars; // NULL while dropped to stay within the memory budget, see lineChars
     int length;
+    char ascii; // no byte above 0x7f, so a column is a byte offset
+    char escapes; // has escape sequences, shown through its cached StyledText
+    char referenced; // used since the memory budget sweep last came by
+    char newline; // ends in '\n'; only the last line of a file may not
+    unsigned char returns; // '\r' bytes before the '\n', kept so that saving writes the ending back as it was
+    long long offset; // of the line and its ending in the opened file, -1 if the line does not read like that there
+    long long spilled; // of the text in the spill file, -1 if it was never written there
+};
+
+struct Position {
+    int line;
+    int column;
+};
+
+struct Selection {
+    int active;
+    struct Position anchor; // where the drag started
+    struct Position head;   // where the drag is now
 };
 
 struct EditorState {
@@ -156,25 +1000,53 @@ struct EditorState {
     int columns;
     int cx, cy; // cursor
 
+    struct Selection selection;
+
     struct Line *lines;
     int lineCount;
-    int lineOffset;
+    int lineOffset; // first row on the screen, a line unless collapsed
+
+    int collapse; // a CollapseMode
+    int *rowLines; // first line of each row while collapsed, then lineCount
+    int rowCount;
+    unsigned long long *lineHashes; // of each line while collapsed, see collapseHash
 
     char *filename;
+    int source; // the opened file, kept open to copy unchanged lines from
 
     char *message;
     time_t messageTime;
 } state;
 
+// defined in later sections
+void memoryCharge(long long bytes);
+void memoryEnforce();
+char *lineChars(struct Line *line);
+void lineFree(struct Line *line);
+void minimapUpdate(int first, int count, int newCount);
+void collapseUpdate(int first, int count, int newCount);
+void minimapDrawRow(int y);
+void paneDraw();
+int paneCursor(int *x, int *y);
+int inputPending();
+int inputFill();
+int inputInterrupted();
+
 void editorInit() {
     state.cx = 0;
     state.cy = 0;
     state.lines = malloc(sizeof(struct Line));
     state.lineCount = 0;
     state.lineOffset = 0;
+    state.selection.active = 0;
+    state.collapse = 0;
+    state.rowLines = NULL;
+    state.rowCount = 0;
+    state.lineHashes = NULL;
     terminalGetSize(&state.rows, &state.columns);
     state.rows -= 1;
     state.filename = NULL;
+    state.source = -1;
     state.message = NULL;
     state.messageTime = 0;
 }
@@ -187,82 +1059,2810 @@ void editorSetStatusMessage(char *message) {
     state.messageTime = time(NULL);
 }
 
-void editorOpenFile(char *filename) {
-    if (state.filename) {
-        free(state.filename);
+int editorRowCount() {
+    return state.collapse ? state.rowCount : state.lineCount;
+}
+
+/* First line shown on the given row; rows past the end continue past the last line. */
+int editorRowLine(int row) {
+    if (!state.collapse) {
+        return row;
     }
-    state.filename = strdup(filename);
+    return row < state.rowCount ? state.rowLines[row] : state.lineCount + row - state.rowCount;
+}
 
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        die("failed to open file");
+#define COLLAPSE_GUTTER 8 // columns for the repeat count of collapsed rows
+
+int editorGutter() {
+    return state.collapse ? COLLAPSE_GUTTER : 0;
+}
+
+/* Whether no byte has the high bit set, looking at eight bytes at a time. */
+int bytesAreAscii(const char *chars, int length) {
+    unsigned long long bits = 0;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        unsigned long long word;
+        memcpy(&word, &chars[i], 8);
+        bits |= word;
+    }
+    for (; i < length; i++) {
+        bits |= (unsigned char) chars[i];
     }
+    return (bits & 0x8080808080808080ULL) == 0;
+}
 
-    char *buffer = NULL;
-    size_t capacity = 0;
-    ssize_t length = 0;
+void lineInit(struct Line *line, const char *chars, int length) {
+    line->length = length;
+    line->chars = malloc((length + 1) * sizeof(char));
+    memcpy(line->chars, chars, length);
+    line->chars[length] = '\0';
+    line->ascii = bytesAreAscii(chars, length);
+    line->escapes = memchr(chars, 0x1b, length) != NULL;
+    line->referenced = 0;
+    line->newline = 1;
+    line->returns = 0;
+    line->offset = -1;
+    line->spilled = -1;
+}
 
-    while ((length = getline(&buffer, &capacity, file)) != -1) {
-        while (length > 0 && (buffer[length - 1] == '\n' || buffer[length - 1] == '\r')) {
-            length--;
+/* Frees the text of a line that was never charged to the memory budget (see lineFree). */
+void lineRelease(struct Line *line) {
+    if (line->chars != NULL) {
+        if (line->escapes) {
+            styleForget(line->chars);
         }
-        state.lines = realloc(state.lines, (1 + state.lineCount) * sizeof(struct Line));
-        struct Line *line = &state.lines[state.lineCount];
-        line->length = length;
-        line->chars = malloc((length + 1) * sizeof(char));
-        memcpy(line->chars, buffer, length);
-        line->chars[length] = '\0';
-        state.lineCount += 1;
+        free(line->chars);
+        line->chars = NULL;
     }
+}
+
+/* What a line shows: its text without escape sequences, and the styles over it. */
+struct LineView {
+    const char *text;
+    int length;
+    int ascii;
+    const struct StyleSpan *spans;
+    int spanCount;
+};
 
-    fclose(file);
-    if (buffer) {
-        free(buffer);
+void lineView(struct Line *line, struct LineView *view) {
+    const char *chars = lineChars(line);
+    view->ascii = line->ascii;
+    if (line->escapes) {
+        struct StyledText *styled = styleLookup(chars, line->length);
+        view->text = styled->text;
+        view->length = styled->length;
+        view->spans = styled->spans;
+        view->spanCount = styled->spanCount;
+    } else {
+        view->text = chars;
+        view->length = line->length;
+        view->spans = &styleDefault;
+        view->spanCount = 1;
     }
 }
 
-void editorDrawLines() {
-    for (int y = 0; y < state.rows; y++) {
-        int lineNumber = state.lineOffset + y;
-        backBufferAppend(ESC "[K", 3);
-        if (lineNumber < state.lineCount) {
-            struct Line *line = &state.lines[lineNumber];
-            backBufferAppend(line->chars, min(line->length, state.columns - 1));
-        } else {
-            backBufferAppend("~", 1);
+/*
+ * Screen columns and byte offsets are the same thing on ASCII lines, which is
+ * nearly all of them; only UTF-8 lines have to be walked character by character.
+ */
+int viewColumns(const struct LineView *view) {
+    if (view->ascii) {
+        return view->length;
+    }
+    int columns = 0;
+    for (int i = 0; i < view->length; i++) {
+        columns += ((unsigned char) view->text[i] & 0xc0) != 0x80;
+    }
+    return columns;
+}
+
+/* Byte offset of the given column, or the length if the text is shorter. */
+int viewOffset(const struct LineView *view, int column) {
+    if (view->ascii) {
+        return min(column, view->length);
+    }
+    int i = 0;
+    for (; i < view->length; i++) {
+        if (((unsigned char) view->text[i] & 0xc0) != 0x80 && column-- == 0) {
+            break;
         }
-        backBufferAppend("\r\n", 2);
     }
+    return i;
+}
 
-    backBufferAppend(ESC "[7m", 4);
-    char status[state.columns];
-    int length = 0;
-    if (state.message == NULL) {
+/* A copy to the clipboard in progress, encoded a few chunks ahead of the terminal. */
+struct Copy {
+    int active;
+    struct Position start;
+    struct Position end;
+    int line; // the next one to encode
+    long bytes;
+} copy;
+
+/* Ends a copy early with what is encoded so far, as the lines it reads from have changed. */
+void editorCopyStop() {
+    if (!copy.active) {
+        return;
+    }
+    clipboardEnd();
+    copy.active = 0;
+    char message[80];
+    snprintf(message, sizeof(message), "an edit cut the copy short, %ld bytes copied to the clipboard", copy.bytes);
+    editorSetStatusMessage(message);
+}
+
+/* Brings the views up to date after count lines at first became newCount lines. */
+void editorLinesChanged(int first, int count, int newCount) {
+    editorCopyStop();
+    minimapUpdate(first, count, newCount);
+    collapseUpdate(first, count, newCount);
+    state.lineOffset = min(state.lineOffset, editorRowCount());
+}
+
+/* Replaces count lines at first with the given lines (taken over, not copied). */
+void editorReplaceLines(int first, int count, struct Line *lines, int lineCount) {
+    if (first < 0 || count < 0 || first + count > state.lineCount) {
+        for (int i = 0; i < lineCount; i++) {
+            lineRelease(&lines[i]);
+        }
+        return;
+    }
+    for (int i = first; i < first + count; i++) {
+        lineFree(&state.lines[i]);
+    }
+    for (int i = 0; i < lineCount; i++) {
+        if (lines[i].chars != NULL) {
+            memoryCharge(lines[i].length + 1); // part of the file now, so it can be dropped
+        }
+    }
+    int newCount = state.lineCount - count + lineCount;
+    if (lineCount > count) {
+        state.lines = realloc(state.lines, (newCount + 1) * sizeof(struct Line));
+    }
+    memmove(&state.lines[first + lineCount], &state.lines[first + count], (state.lineCount - first - count) * sizeof(struct Line));
+    memcpy(&state.lines[first], lines, lineCount * sizeof(struct Line));
+    state.lineCount = newCount;
+    state.selection.active = 0;
+    editorLinesChanged(first, count, lineCount);
+}
+
+/* Adds a line read at offset of the file; length includes the line ending, if any. */
+void editorLoadLine(const char *chars, long length, long long offset, int *capacity) {
+    int newline = length > 0 && chars[length - 1] == '\n';
+    long end = length - newline;
+    int returns = 0;
+    while (end > 0 && chars[end - 1] == '\r' && returns < 255) {
+        end--;
+        returns++;
+    }
+    if (state.lineCount == *capacity) {
+        *capacity = *capacity * 2 + 1024;
+        state.lines = realloc(state.lines, (*capacity + 1) * sizeof(struct Line));
+    }
+    lineInit(&state.lines[state.lineCount], chars, end);
+    memoryCharge(end + 1);
+    state.lines[state.lineCount].newline = newline;
+    state.lines[state.lineCount].returns = returns;
+    state.lines[state.lineCount].offset = offset;
+    state.lineCount += 1;
+}
+
+/*
+ * Reads the file in large chunks, several of them in flight at once, and cuts
+ * each chunk into lines with memchr while the next ones are being read.
+ */
+void editorOpenFile(char *filename) {
+    if (state.filename) {
+        free(state.filename);
+    }
+    state.filename = strdup(filename);
+
+    int fd = open(filename, O_RDONLY);
+    struct ChunkReader reader;
+    if (fd == -1 || chunkReaderInit(&reader, fd, filename) == -1) {
+        die("failed to open file");
+    }
+    state.source = fd; // lines can be dropped while the rest is still loading
+
+    char *partial = NULL; // a line cut in two by the end of a chunk
+    long partialLength = 0;
+    long partialCapacity = 0;
+    long long partialOffset = 0;
+    long long offset = 0;
+    int capacity = state.lineCount;
+    char *data;
+    long length;
+
+    while ((length = chunkReaderNext(&reader, &data)) > 0) {
+        long start = 0;
+        char *newline;
+        while ((newline = memchr(&data[start], '\n', length - start)) != NULL) {
+            long end = newline - data + 1;
+            if (partialLength > 0) {
+                if (partialLength + end - start > partialCapacity) {
+                    partialCapacity = (partialLength + end - start) * 2;
+                    partial = realloc(partial, partialCapacity);
+                }
+                memcpy(&partial[partialLength], &data[start], end - start);
+                editorLoadLine(partial, partialLength + end - start, partialOffset, &capacity);
+                partialLength = 0;
+            } else {
+                editorLoadLine(&data[start], end - start, offset + start, &capacity);
+            }
+            start = end;
+        }
+        if (start < length) {
+            if (partialLength == 0) {
+                partialOffset = offset + start;
+            }
+            if (partialLength + length - start > partialCapacity) {
+                partialCapacity = (partialLength + length - start) * 2;
+                partial = realloc(partial, partialCapacity);
+            }
+            memcpy(&partial[partialLength], &data[start], length - start);
+            partialLength += length - start;
+        }
+        offset += length;
+        memoryEnforce();
+    }
+    if (length == -1) {
+        die("read");
+    }
+    if (partialLength > 0) {
+        editorLoadLine(partial, partialLength, partialOffset, &capacity);
+    }
+
+    chunkReaderDestroy(&reader);
+    free(partial);
+}
+
+int positionCompare(struct Position a, struct Position b) {
+    return a.line != b.line ? a.line - b.line : a.column - b.column;
+}
+
+/* Selected columns [from, to) of the given line; returns 0 if nothing on the line is selected. */
+int editorSelectionOnLine(int lineNumber, int length, int *from, int *to) {
+    if (!state.selection.active) {
+        return 0;
+    }
+    struct Position start = state.selection.anchor;
+    struct Position end = state.selection.head;
+    if (positionCompare(start, end) > 0) {
+        start = state.selection.head;
+        end = state.selection.anchor;
+    }
+    if (lineNumber < start.line || lineNumber > end.line) {
+        return 0;
+    }
+    *from = lineNumber == start.line ? min(start.column, length) : 0;
+    *to = lineNumber == end.line ? min(end.column, length) : length;
+    return *from < *to;
+}
+
+/* Draws the first length bytes of the text in its styles, [from, to) reversed for the selection. */
+void editorDrawText(const struct LineView *view, int length, int from, int to) {
+    if (view->spanCount == 1 && view->spans[0].style.flags == 0 && view->spans[0].style.fg == -1 && view->spans[0].style.bg == -1) {
+        // plain text, the usual case
+        if (from < to) {
+            backBufferAppend(view->text, from);
+            backBufferAppend(ESC "[7m", 4);
+            backBufferAppend(&view->text[from], to - from);
+            backBufferAppend(ESC "[m", 3);
+            backBufferAppend(&view->text[to], length - to);
+        } else {
+            backBufferAppend(view->text, length);
+        }
+        return;
+    }
+    int span = 0;
+    for (int position = 0; position < length; ) {
+        while (span + 1 < view->spanCount && view->spans[span + 1].from <= position) {
+            span++;
+        }
+        int end = span + 1 < view->spanCount ? min(view->spans[span + 1].from, length) : length;
+        int selected = position >= from && position < to;
+        end = min(end, selected ? to : (position < from ? from : length));
+        styleAppend(&view->spans[span].style, selected);
+        backBufferAppend(&view->text[position], end - position);
+        position = end;
+    }
+    backBufferAppend(ESC "[m", 3);
+}
+
+void editorDrawLines() {
+    int gutter = editorGutter();
+    for (int y = 0; y < state.rows; y++) {
+        int row = state.lineOffset + y;
+        int lineNumber = editorRowLine(row);
+        backBufferAppend(ESC "[K", 3);
+        if (lineNumber < state.lineCount) {
+            if (gutter > 0) {
+                char count[32];
+                int repeats = editorRowLine(row + 1) - lineNumber;
+                if (repeats >= 10000000) {
+                    snprintf(count, sizeof(count), "%*dM ", COLLAPSE_GUTTER - 2, repeats / 1000000);
+                } else if (repeats > 1) {
+                    snprintf(count, sizeof(count), "%*d ", COLLAPSE_GUTTER - 1, repeats);
+                } else {
+                    snprintf(count, sizeof(count), "%*s", gutter, "");
+                }
+                backBufferAppend(count, gutter);
+            }
+            struct LineView view;
+            lineView(&state.lines[lineNumber], &view);
+            int width = max(0, state.columns - 1 - gutter);
+            int from = 0, to = 0;
+            if (editorSelectionOnLine(lineNumber, width, &from, &to)) {
+                from = viewOffset(&view, from);
+                to = viewOffset(&view, to);
+            }
+            editorDrawText(&view, viewOffset(&view, width), from, to);
+        } else {
+            backBufferAppend("~", 1);
+        }
+        minimapDrawRow(y);
+        backBufferAppend("\r\n", 2);
+    }
+    paneDraw();
+
+    backBufferAppend(ESC "[7m", 4);
+    char status[state.columns];
+    int length = 0;
+    if (state.message == NULL) {
         length = snprintf(status, sizeof(status), "%.20s - %d lines    line: %d  column: %d", 
             state.filename ? state.filename : "[no file]", 
             state.lineCount,
-            state.lineOffset + state.cy,
+            editorRowLine(state.lineOffset + state.cy),
             state.cx);
         length = min(length, state.columns);
         backBufferAppend(status, length);
     } else {
-        length = min(strlen(state.message), state.columns);
-        backBufferAppend(state.message, length);
-        if (time(NULL) - state.messageTime > 5) {
-            //free(state.message);
-            state.message = NULL;
-            state.messageTime = 0;
+        length = min(strlen(state.message), state.columns);
+        backBufferAppend(state.message, length);
+        if (time(NULL) - state.messageTime > 5) {
+            //free(state.message);
+            state.message = NULL;
+            state.messageTime = 0;
+        }
+    }
+    while (length < state.columns) {
+        backBufferAppend(" ", 1);
+        length++;
+    }
+    backBufferAppend(ESC "[m", 3);
+}
+
+void editorRefreshScreen() {
+    if (clipboardPending()) {
+        return; // drawn once the clipboard sequence is out
+    }
+    terminalCursorHide();
+    terminalCursorHome();
+    backBufferClear();
+    editorDrawLines();
+    backBufferRender();
+    int x = state.cx, y = state.cy;
+    paneCursor(&x, &y);
+    terminalSetCursorPosition(x, y);
+    terminalCursorShow();
+}
+
+/* Encodes more of the selection until the clipboard queue is full, and ends the sequence after the last line. */
+void editorCopyContinue() {
+    while (copy.active && copy.line <= copy.end.line && !clipboardFull()) {
+        struct LineView view;
+        lineView(&state.lines[copy.line], &view);
+        int columns = viewColumns(&view);
+        int from = copy.line == copy.start.line ? min(copy.start.column, columns) : 0;
+        int to = copy.line == copy.end.line ? min(copy.end.column, columns) : columns;
+        if (from < to) {
+            from = viewOffset(&view, from);
+            to = viewOffset(&view, to);
+            base64Feed(&view.text[from], to - from);
+            copy.bytes += to - from;
+        }
+        if (copy.line < copy.end.line) {
+            base64Feed("\n", 1);
+            copy.bytes += 1;
+        }
+        copy.line++;
+        memoryEnforce();
+    }
+    if (copy.active && copy.line > copy.end.line) {
+        clipboardEnd();
+        copy.active = 0;
+        char message[64];
+        snprintf(message, sizeof(message), "copied %ld bytes to the clipboard", copy.bytes);
+        editorSetStatusMessage(message);
+    }
+}
+
+/* Copies the selected text, lines joined by '\n', to the system clipboard; the main loop sends it. */
+void editorCopySelection() {
+    if (copy.active) {
+        editorSetStatusMessage("still copying the last selection");
+        return;
+    }
+    if (!state.selection.active) {
+        editorSetStatusMessage("nothing selected");
+        return;
+    }
+    copy.start = state.selection.anchor;
+    copy.end = state.selection.head;
+    if (positionCompare(copy.start, copy.end) > 0) {
+        copy.start = state.selection.head;
+        copy.end = state.selection.anchor;
+    }
+    if (copy.end.line > state.lineCount - 1) { // the selection runs past the last line
+        copy.end.line = state.lineCount - 1;
+        copy.end.column = copy.end.line >= 0 ? state.lines[copy.end.line].length : 0;
+    }
+    copy.line = copy.start.line;
+    copy.bytes = 0;
+    copy.active = 1;
+    clipboardBegin();
+    editorCopyContinue();
+}
+
+/* Sends the rest of a copy to the terminal, waiting for it; for modal loops that draw on their own. */
+void editorCopyWait() {
+    while (copy.active || clipboardPending()) {
+        struct pollfd fd = { STDOUT_FILENO, POLLOUT, 0 };
+        if (poll(&fd, 1, -1) == -1 && errno != EINTR) {
+            die("poll");
+        }
+        clipboardDrain();
+        editorCopyContinue();
+    }
+}
+
+/** MEMORY BUDGET ************************************************************/
+
+/*
+ * Line text can be dropped from memory and brought back when needed: lines
+ * that read as they do in the opened file are read back from it, other lines
+ * are written once to a spill file first (lines never change in place, so one
+ * copy there stays good). Once the text in memory grows past the budget, a
+ * clock sweep, which approximates least recently used order, drops text until
+ * it is back under seven eighths of the budget. Lines on the screen stay.
+ * Only the text of the file's lines is charged, as only it can be dropped;
+ * the struct Line array, filter output on its way in and the pane's
+ * scrollback are not. A sweep that frees nothing is not retried until the
+ * text has grown by another eighth of the budget.
+ */
+
+struct Memory {
+    long long budget; // bytes of line text, 0 for no limit
+    long long used;
+    int hand;         // where the clock sweep goes on
+    int spill;        // unlinked temporary file, -1 until needed
+    long long spillEnd;
+    long long stalled; // what was in use after the last sweep that freed nothing, 0 if none
+} memory = { 0, 0, 0, -1, 0, 0 };
+
+void memoryCharge(long long bytes) {
+    memory.used += bytes;
+}
+
+/* Frees the text of a line of the file. */
+void lineFree(struct Line *line) {
+    if (line->chars != NULL) {
+        memory.used -= line->length + 1;
+        lineRelease(line);
+    }
+}
+
+/* The text of the line, read back if it was dropped. */
+char *lineChars(struct Line *line) {
+    line->referenced = 1;
+    if (line->chars != NULL) {
+        return line->chars;
+    }
+    char *chars = malloc(line->length + 1);
+    long n = line->spilled != -1
+        ? preadFully(memory.spill, chars, line->length, line->spilled)
+        : preadFully(state.source, chars, line->length, line->offset);
+    if (n != line->length) {
+        die("failed to read a line back");
+    }
+    chars[line->length] = '\0';
+    line->chars = chars;
+    memoryCharge(line->length + 1);
+    return chars;
+}
+
+/*
+ * The text of the line for a thread other than the main one: a dropped line
+ * is read into the caller's buffer, and nothing about the line changes.
+ */
+const char *linePeek(const struct Line *line, char **buffer, int *capacity) {
+    if (line->chars != NULL) {
+        return line->chars;
+    }
+    if (*capacity < line->length + 1) {
+        *capacity = line->length + 1;
+        *buffer = realloc(*buffer, *capacity);
+    }
+    long n = line->spilled != -1
+        ? preadFully(memory.spill, *buffer, line->length, line->spilled)
+        : preadFully(state.source, *buffer, line->length, line->offset);
+    if (n != line->length) {
+        die("failed to read a line back");
+    }
+    return *buffer;
+}
+
+/* Creates the spill file if there is none yet; returns 0 or -1. */
+int memorySpillOpen() {
+    if (memory.spill == -1) {
+        char name[] = "/tmp/kilo-spill.XXXXXX";
+        memory.spill = mkstemp(name);
+        if (memory.spill == -1) {
+            return -1;
+        }
+        unlink(name);
+    }
+    return 0;
+}
+
+/* Writes the line to the spill file; returns 0 or -1. */
+int memorySpill(struct Line *line) {
+    if (memorySpillOpen() == -1) {
+        return -1;
+    }
+    if (pwriteFully(memory.spill, line->chars, line->length, memory.spillEnd) == -1) {
+        return -1;
+    }
+    line->spilled = memory.spillEnd;
+    memory.spillEnd += line->length;
+    return 0;
+}
+
+/* Drops line text, least recently used first, until the budget is kept again. */
+void memoryEnforce() {
+    if (memory.budget == 0 || memory.used <= memory.budget || state.lineCount == 0) {
+        return;
+    }
+    if (memory.stalled != 0 && memory.used <= memory.stalled + memory.budget / 8) {
+        return; // nothing could be dropped last time, and little has been added since
+    }
+    long long before = memory.used;
+    long long target = memory.budget / 8 * 7;
+    int visibleFrom = editorRowLine(state.lineOffset);
+    int visibleTo = editorRowLine(state.lineOffset + state.rows);
+    // the second time round, lines passed over once for being referenced go too
+    for (long long steps = 2LL * state.lineCount; steps > 0 && memory.used > target; steps--) {
+        if (memory.hand >= state.lineCount) {
+            memory.hand = 0;
+        }
+        struct Line *line = &state.lines[memory.hand];
+        int visible = memory.hand >= visibleFrom && memory.hand < visibleTo;
+        memory.hand++;
+        if (line->chars == NULL || visible) {
+            continue;
+        }
+        if (line->referenced) {
+            line->referenced = 0;
+            continue;
+        }
+        int clean = line->offset != -1 && state.source != -1;
+        if (!clean && line->spilled == -1 && memorySpill(line) == -1) {
+            continue; // nowhere to put it, it stays
+        }
+        lineFree(line);
+    }
+    if (memory.used == before) {
+        memory.stalled = memory.used;
+        return;
+    }
+    memory.stalled = 0;
+    malloc_trim(0); // hand the freed memory back to the system, not just to malloc
+}
+
+/* ":budget" shows the memory in use, ":budget N" sets the budget to N MB (0 for none). */
+void memoryCommand(const char *argument) {
+    char message[128];
+    if (argument != NULL) {
+        memory.budget = atoll(argument) << 20;
+        memory.stalled = 0;
+        memoryEnforce();
+    }
+    snprintf(message, sizeof(message), "line text in memory: %lld MB, budget: %lld MB, spilled: %lld MB",
+        memory.used >> 20, memory.budget >> 20, memory.spillEnd >> 20);
+    editorSetStatusMessage(message);
+}
+
+/** LINE OPERATIONS **********************************************************/
+
+#define SORT_PARALLEL_THRESHOLD 65536 // fewer lines are sorted on one thread
+#define SORT_MAX_THREADS 16
+
+struct SortKey {
+    unsigned long long prefix; // first 8 bytes big-endian, so comparing prefixes compares bytes
+    struct Line line;
+};
+
+struct SortTask {
+    struct SortKey *source;
+    struct SortKey *target;
+    int from, middle, to; // sorts [from, to), or merges [from, middle) and [middle, to) into target
+    pthread_t thread;
+};
+
+int sortKeyCompare(const void *a, const void *b) {
+    const struct SortKey *x = a;
+    const struct SortKey *y = b;
+    if (x->prefix != y->prefix) {
+        return x->prefix < y->prefix ? -1 : 1;
+    }
+    int c = memcmp(x->line.chars, y->line.chars, min(x->line.length, y->line.length));
+    return c != 0 ? c : x->line.length - y->line.length;
+}
+
+void *sortTaskSort(void *argument) {
+    struct SortTask *task = argument;
+    qsort(&task->source[task->from], task->to - task->from, sizeof(struct SortKey), sortKeyCompare);
+    return NULL;
+}
+
+void *sortTaskMerge(void *argument) {
+    struct SortTask *task = argument;
+    int i = task->from, j = task->middle, k = task->from;
+    while (i < task->middle && j < task->to) {
+        task->target[k++] = sortKeyCompare(&task->source[j], &task->source[i]) < 0 ? task->source[j++] : task->source[i++];
+    }
+    while (i < task->middle) {
+        task->target[k++] = task->source[i++];
+    }
+    while (j < task->to) {
+        task->target[k++] = task->source[j++];
+    }
+    return NULL;
+}
+
+/* Runs the tasks on their own threads, the last one on this thread. */
+void sortRunTasks(struct SortTask *tasks, int count, void *(*run)(void *)) {
+    for (int i = 0; i < count - 1; i++) {
+        if (pthread_create(&tasks[i].thread, NULL, run, &tasks[i]) != 0) {
+            run(&tasks[i]);
+            tasks[i].thread = 0;
+        }
+    }
+    run(&tasks[count - 1]);
+    for (int i = 0; i < count - 1; i++) {
+        if (tasks[i].thread != 0) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+    }
+}
+
+/*
+ * Sorts the chunks in parallel and then merges pairs of sorted runs,
+ * also in parallel, until one run is left.
+ */
+void sortKeys(struct SortKey *keys, int count) {
+    int threads = count < SORT_PARALLEL_THRESHOLD ? 1 : min(SORT_MAX_THREADS, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    if (threads <= 1) {
+        qsort(keys, count, sizeof(struct SortKey), sortKeyCompare);
+        return;
+    }
+
+    struct SortTask tasks[SORT_MAX_THREADS];
+    int bounds[SORT_MAX_THREADS + 1];
+    for (int i = 0; i <= threads; i++) {
+        bounds[i] = (int) ((long) count * i / threads);
+    }
+    for (int i = 0; i < threads; i++) {
+        tasks[i].source = keys;
+        tasks[i].from = bounds[i];
+        tasks[i].to = bounds[i + 1];
+    }
+    sortRunTasks(tasks, threads, sortTaskSort);
+
+    struct SortKey *scratch = malloc(count * sizeof(struct SortKey));
+    if (scratch == NULL) {
+        die("out of memory");
+    }
+    struct SortKey *source = keys;
+    struct SortKey *target = scratch;
+    int runs = threads;
+    while (runs > 1) {
+        int merges = 0;
+        for (int i = 0; i < runs; i += 2) {
+            struct SortTask *task = &tasks[merges++];
+            task->source = source;
+            task->target = target;
+            task->from = bounds[i];
+            task->middle = bounds[i + 1];
+            task->to = i + 1 < runs ? bounds[i + 2] : bounds[i + 1]; // an odd run is merged with nothing
+            bounds[i / 2] = bounds[i];
+        }
+        bounds[merges] = count;
+        sortRunTasks(tasks, merges, sortTaskMerge);
+        runs = merges;
+        struct SortKey *swap = source;
+        source = target;
+        target = swap;
+    }
+    if (source != keys) {
+        memcpy(keys, source, count * sizeof(struct SortKey));
+    }
+    free(scratch);
+}
+
+/* Lines the command works on: the selected ones, or all of them. The range is empty (last < first) when none are. */
+void editorCommandRange(int *first, int *last) {
+    if (state.selection.active) {
+        *first = min(min(state.selection.anchor.line, state.selection.head.line), state.lineCount);
+        *last = min(max(state.selection.anchor.line, state.selection.head.line), state.lineCount - 1);
+    } else {
+        *first = 0;
+        *last = state.lineCount - 1;
+    }
+}
+
+void sortKeyInit(struct SortKey *key, struct Line *line) {
+    const char *chars = lineChars(line); // the sort threads only see lines in memory
+    unsigned long long prefix = 0;
+    for (int j = 0; j < 8; j++) {
+        prefix = prefix << 8 | (j < line->length ? (unsigned char) chars[j] : 0);
+    }
+    key->prefix = prefix;
+    key->line = *line;
+}
+
+/*
+ * A range with more text than the memory budget is sorted externally: runs
+ * that fit in half the budget are sorted in memory and written to the spill
+ * file one after the other, then all runs are merged at once through a heap,
+ * each read back through a buffer of its own. The sorted lines are left
+ * dropped, pointing at their place in the spill file.
+ */
+struct SortRun {
+    struct Line *lines; // sorted, the text of each right after the one before in the spill file
+    int count;
+    int next;           // the line to merge next
+    char *buffer;       // text from the spill file, line next at position
+    int capacity;
+    int length;
+    int position;
+};
+
+/* Sorts the lines [from, to) and writes their text to the spill file as a run. */
+void sortRunSpill(int from, int to, struct SortRun *run) {
+    int count = to - from;
+    struct SortKey *keys = malloc(count * sizeof(struct SortKey));
+    char *buffer = malloc(IO_CHUNK);
+    if (keys == NULL || buffer == NULL) {
+        die("out of memory");
+    }
+    for (int i = 0; i < count; i++) {
+        sortKeyInit(&keys[i], &state.lines[from + i]);
+        state.lines[from + i].chars = NULL; // the key owns the text now
+    }
+    sortKeys(keys, count);
+
+    run->lines = malloc(count * sizeof(struct Line));
+    run->count = count;
+    int length = 0;
+    long long position = memory.spillEnd;
+    for (int i = 0; i < count; i++) {
+        struct Line line = keys[i].line;
+        if (length + line.length > IO_CHUNK) {
+            if (pwriteFully(memory.spill, buffer, length, position) == -1) {
+                die("failed to write the spill file");
+            }
+            position += length;
+            length = 0;
+        }
+        if (line.length > IO_CHUNK) {
+            if (pwriteFully(memory.spill, line.chars, line.length, position) == -1) {
+                die("failed to write the spill file");
+            }
+            position += line.length;
+        } else {
+            memcpy(&buffer[length], line.chars, line.length);
+            length += line.length;
+        }
+        line.spilled = memory.spillEnd;
+        memory.spillEnd += line.length;
+        line.referenced = 0;
+        lineFree(&line);
+        run->lines[i] = line;
+    }
+    if (pwriteFully(memory.spill, buffer, length, position) == -1) {
+        die("failed to write the spill file");
+    }
+    free(buffer);
+    free(keys);
+}
+
+/* Makes sure the whole text of line next of the run is in its buffer. */
+void sortRunFill(struct SortRun *run) {
+    struct Line *line = &run->lines[run->next];
+    if (run->position + line->length <= run->length) {
+        return;
+    }
+    memmove(run->buffer, &run->buffer[run->position], run->length - run->position);
+    run->length -= run->position;
+    run->position = 0;
+    if (line->length > run->capacity) {
+        run->capacity = line->length;
+        run->buffer = realloc(run->buffer, run->capacity);
+    }
+    struct Line *end = &run->lines[run->count - 1];
+    long long from = line->spilled + run->length;
+    long wanted = run->capacity - run->length;
+    if (end->spilled + end->length - from < wanted) {
+        wanted = end->spilled + end->length - from; // the run ends before the buffer does
+    }
+    if (preadFully(memory.spill, &run->buffer[run->length], wanted, from) != wanted) {
+        die("failed to read the spill file");
+    }
+    run->length += wanted;
+}
+
+int sortRunCompare(const struct SortRun *a, const struct SortRun *b) {
+    const struct Line *x = &a->lines[a->next];
+    const struct Line *y = &b->lines[b->next];
+    int c = memcmp(&a->buffer[a->position], &b->buffer[b->position], min(x->length, y->length));
+    return c != 0 ? c : x->length - y->length;
+}
+
+/* Moves the run at i down the min-heap to where it belongs. */
+void sortHeapDown(struct SortRun **heap, int count, int i) {
+    for (;;) {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++) {
+            if (sortRunCompare(heap[child], heap[smallest]) < 0) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) {
+            return;
+        }
+        struct SortRun *swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+/* Sorts lines [first, last] in runs of at most runBytes of text; returns the number of runs. */
+int sortExternal(int first, int last, long long runBytes) {
+    int capacity = 16, count = 0;
+    struct SortRun *runs = malloc(capacity * sizeof(struct SortRun));
+    for (int from = first; from <= last;) {
+        int to = from;
+        long long bytes = 0;
+        while (to <= last && (to == from || bytes + state.lines[to].length + 1 <= runBytes)) {
+            bytes += state.lines[to++].length + 1;
+        }
+        memoryEnforce(); // lines not yet in a run may still be dropped, those in one are
+        if (count == capacity) {
+            capacity *= 2;
+            runs = realloc(runs, capacity * sizeof(struct SortRun));
+        }
+        sortRunSpill(from, to, &runs[count++]);
+        from = to;
+    }
+
+    struct SortRun **heap = malloc(count * sizeof(struct SortRun *));
+    int bufferSize = max(4096, (int) min(IO_CHUNK, runBytes / count));
+    for (int i = 0; i < count; i++) {
+        runs[i].next = runs[i].length = runs[i].position = 0;
+        runs[i].capacity = bufferSize;
+        runs[i].buffer = malloc(bufferSize);
+        sortRunFill(&runs[i]);
+        heap[i] = &runs[i];
+    }
+    for (int i = count / 2 - 1; i >= 0; i--) {
+        sortHeapDown(heap, count, i);
+    }
+    int heapCount = count;
+    for (int i = first; heapCount > 0; i++) {
+        struct SortRun *run = heap[0];
+        state.lines[i] = run->lines[run->next];
+        run->position += run->lines[run->next].length;
+        if (++run->next < run->count) {
+            sortRunFill(run);
+        } else {
+            heap[0] = heap[--heapCount];
+        }
+        sortHeapDown(heap, heapCount, 0);
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(runs[i].lines);
+        free(runs[i].buffer);
+    }
+    free(heap);
+    free(runs);
+    return count;
+}
+
+void editorSortLines() {
+    int first, last;
+    editorCommandRange(&first, &last);
+    int count = last - first + 1;
+    if (count < 2) {
+        return;
+    }
+
+    char message[64];
+    long long bytes = 0;
+    for (int i = first; i <= last; i++) {
+        bytes += state.lines[i].length + 1;
+    }
+    if (memory.budget != 0 && bytes > memory.budget && memorySpillOpen() == 0) {
+        int runs = sortExternal(first, last, memory.budget / 2);
+        editorLinesChanged(first, count, count);
+        snprintf(message, sizeof(message), "sorted %d lines in %d runs", count, runs);
+        editorSetStatusMessage(message);
+        return;
+    }
+
+    struct SortKey *keys = malloc(count * sizeof(struct SortKey));
+    if (keys == NULL) {
+        die("out of memory");
+    }
+    for (int i = 0; i < count; i++) {
+        sortKeyInit(&keys[i], &state.lines[first + i]);
+    }
+    sortKeys(keys, count);
+    for (int i = 0; i < count; i++) {
+        state.lines[first + i] = keys[i].line;
+    }
+    free(keys);
+    editorLinesChanged(first, count, count);
+    memoryEnforce(); // the keys needed every line in memory at once
+
+    snprintf(message, sizeof(message), "sorted %d lines", count);
+    editorSetStatusMessage(message);
+}
+
+/* Drops lines equal to the line before them, as uniq does. */
+void editorUniqueLines() {
+    int first, last;
+    editorCommandRange(&first, &last);
+    if (last - first < 1) {
+        return;
+    }
+
+    int kept = first + 1;
+    for (int i = first + 1; i <= last; i++) {
+        struct Line *previous = &state.lines[kept - 1];
+        struct Line *line = &state.lines[i];
+        if (line->length == previous->length && memcmp(lineChars(line), lineChars(previous), line->length) == 0) {
+            lineFree(line);
+        } else if (kept++ != i) {
+            state.lines[kept - 1] = *line;
+            line->chars = NULL; // moved, so the sweep must not free it through this slot
+        }
+        memoryEnforce();
+    }
+    int removed = last + 1 - kept;
+    memmove(&state.lines[kept], &state.lines[last + 1], (state.lineCount - last - 1) * sizeof(struct Line));
+    state.lineCount -= removed;
+    state.selection.active = 0;
+    editorLinesChanged(first, last - first + 1, kept - first);
+
+    char message[64];
+    snprintf(message, sizeof(message), "removed %d duplicate lines", removed);
+    editorSetStatusMessage(message);
+}
+
+/** COLLAPSE *****************************************************************/
+
+/*
+ * A view that shows each run of equal lines as one row with a repeat count.
+ * Lines are compared by a 64-bit hash, optionally of a template where every
+ * run of hex digits containing a decimal digit counts as the same token, so
+ * that "took 12 ms" and "took 345 ms" collapse together; exact runs are
+ * confirmed byte by byte, so a hash collision cannot hide a line. Turning the
+ * view on hashes ranges of lines on several threads, each listing the runs
+ * starting in its range, and keeps the hash of every line. An edit then only
+ * hashes the lines it brought in and patches the rows around them.
+ * Dropped lines are read back without keeping them, so hashing neither
+ * touches the memory budget's bookkeeping nor pulls the whole file in.
+ */
+
+#define COLLAPSE_PARALLEL_THRESHOLD 65536 // fewer lines are hashed on one thread
+
+enum CollapseMode {
+    COLLAPSE_OFF,
+    COLLAPSE_EXACT,
+    COLLAPSE_MASKED
+};
+
+struct CollapseTask {
+    int from, to; // lines
+    int *starts;  // lines in [from, to) that start a run
+    int count;
+    int capacity;
+    pthread_t thread;
+};
+
+int isHexDigit(int c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+unsigned long long collapseHash(const char *chars, int length, int masked) {
+    const unsigned long long prime = 0x100000001b3ULL;
+    unsigned long long hash = 0xcbf29ce484222325ULL; // FNV-1a
+    int i = 0;
+    while (i < length) {
+        if (masked && isHexDigit((unsigned char) chars[i])) {
+            int end = i;
+            int digits = 0;
+            while (end < length && isHexDigit((unsigned char) chars[end])) {
+                digits |= isdigit((unsigned char) chars[end]);
+                end++;
+            }
+            if (digits) {
+                hash = (hash ^ '#') * prime;
+                i = end;
+                continue;
+            }
+            for (; i < end; i++) {
+                hash = (hash ^ (unsigned char) chars[i]) * prime; // a word that happens to be hex
+            }
+            continue;
+        }
+        hash = (hash ^ (unsigned char) chars[i++]) * prime;
+    }
+    return masked ? hash : hash ^ (unsigned long long) length << 40;
+}
+
+unsigned long long collapseLineHash(const struct Line *line, char **buffer, int *capacity) {
+    return collapseHash(linePeek(line, buffer, capacity), line->length, state.collapse == COLLAPSE_MASKED);
+}
+
+/* Whether line b continues the run of line a, given their hashes; buffers holds two peek buffers. */
+int collapseSame(int a, int b, char **buffers, int *capacities) {
+    if (state.lineHashes[a] != state.lineHashes[b]) {
+        return 0;
+    }
+    if (state.collapse == COLLAPSE_MASKED) {
+        return 1;
+    }
+    const struct Line *x = &state.lines[a];
+    const struct Line *y = &state.lines[b];
+    if (x->length != y->length) {
+        return 0;
+    }
+    const char *text = linePeek(x, &buffers[0], &capacities[0]);
+    return memcmp(text, linePeek(y, &buffers[1], &capacities[1]), x->length) == 0;
+}
+
+void *collapseTaskRun(void *argument) {
+    struct CollapseTask *task = argument;
+    char *buffers[2] = { NULL, NULL };
+    int capacities[2] = { 0, 0 };
+    task->count = 0;
+    task->capacity = 1024;
+    task->starts = malloc(task->capacity * sizeof(int));
+    const char *previous = NULL;
+    unsigned long long previousHash = 0;
+    if (task->from > 0) {
+        // the line before the range belongs to another thread: hash it here, store nothing
+        previous = linePeek(&state.lines[task->from - 1], &buffers[0], &capacities[0]);
+        previousHash = collapseHash(previous, state.lines[task->from - 1].length, state.collapse == COLLAPSE_MASKED);
+    }
+    for (int i = task->from; i < task->to; i++) {
+        // the text of line i goes to the buffer that line i - 1 is not in
+        int slot = previous == buffers[1] ? 0 : 1;
+        const char *text = linePeek(&state.lines[i], &buffers[slot], &capacities[slot]);
+        unsigned long long hash = collapseHash(text, state.lines[i].length, state.collapse == COLLAPSE_MASKED);
+        state.lineHashes[i] = hash;
+        int same = i > 0 && hash == previousHash
+            && (state.collapse == COLLAPSE_MASKED
+                || (state.lines[i].length == state.lines[i - 1].length && memcmp(text, previous, state.lines[i].length) == 0));
+        if (!same) {
+            if (task->count == task->capacity) {
+                task->capacity *= 2;
+                task->starts = realloc(task->starts, task->capacity * sizeof(int));
+            }
+            task->starts[task->count++] = i;
+        }
+        previous = text;
+        previousHash = hash;
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+    return NULL;
+}
+
+/* Hashes all lines and lists the rows of the collapsed view from scratch. */
+void collapseBuild() {
+    free(state.rowLines);
+    free(state.lineHashes);
+    state.rowLines = NULL;
+    state.lineHashes = NULL;
+    state.rowCount = 0;
+    if (state.collapse == COLLAPSE_OFF) {
+        return;
+    }
+    state.lineHashes = malloc((state.lineCount + 1) * sizeof(unsigned long long));
+
+    int threads = state.lineCount < COLLAPSE_PARALLEL_THRESHOLD ? 1 : min(SORT_MAX_THREADS, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    threads = max(threads, 1);
+    struct CollapseTask tasks[SORT_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        tasks[i].from = (int) ((long) state.lineCount * i / threads);
+        tasks[i].to = (int) ((long) state.lineCount * (i + 1) / threads);
+    }
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&tasks[i].thread, NULL, collapseTaskRun, &tasks[i]) != 0) {
+            collapseTaskRun(&tasks[i]);
+            tasks[i].thread = 0;
+        }
+    }
+    collapseTaskRun(&tasks[threads - 1]);
+    int rows = 0;
+    for (int i = 0; i < threads; i++) {
+        if (i < threads - 1 && tasks[i].thread != 0) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+        rows += tasks[i].count;
+    }
+
+    state.rowLines = malloc((rows + 1) * sizeof(int));
+    for (int i = 0; i < threads; i++) {
+        memcpy(&state.rowLines[state.rowCount], tasks[i].starts, tasks[i].count * sizeof(int));
+        state.rowCount += tasks[i].count;
+        free(tasks[i].starts);
+    }
+    state.rowLines[state.rowCount] = state.lineCount;
+}
+
+/* First row whose line is at least line. */
+int collapseRowAtOrAfter(int line) {
+    int low = 0, high = state.rowCount;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (state.rowLines[middle] < line) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*
+ * Brings the rows up to date after count lines at first became newCount
+ * lines: only the new lines are hashed, and only rows starting among them or
+ * on the line right after them can change; the rows after that move along.
+ */
+void collapseUpdate(int first, int count, int newCount) {
+    if (state.collapse == COLLAPSE_OFF) {
+        return;
+    }
+    int oldLineCount = state.lineCount - newCount + count;
+    int end = first + newCount; // the first line after the new ones
+    int from = collapseRowAtOrAfter(first);
+    int to = collapseRowAtOrAfter(first + count + 1); // rows starting after the old line first + count keep their start
+
+    int shift = newCount - count;
+    if (shift > 0) {
+        state.lineHashes = realloc(state.lineHashes, (state.lineCount + 1) * sizeof(unsigned long long));
+    }
+    memmove(&state.lineHashes[end], &state.lineHashes[first + count], (oldLineCount - first - count) * sizeof(unsigned long long));
+
+    char *buffers[2] = { NULL, NULL };
+    int capacities[2] = { 0, 0 };
+    for (int i = first; i < end; i++) {
+        state.lineHashes[i] = collapseLineHash(&state.lines[i], &buffers[0], &capacities[0]);
+    }
+    int *starts = malloc((newCount + 1) * sizeof(int));
+    int startCount = 0;
+    for (int i = first; i <= end && i < state.lineCount; i++) {
+        if (i == 0 || !collapseSame(i - 1, i, buffers, capacities)) {
+            starts[startCount++] = i;
+        }
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+
+    int tail = state.rowCount - to;
+    int rowCount = from + startCount + tail;
+    if (rowCount > state.rowCount) {
+        state.rowLines = realloc(state.rowLines, (rowCount + 1) * sizeof(int));
+    }
+    memmove(&state.rowLines[from + startCount], &state.rowLines[to], tail * sizeof(int));
+    memcpy(&state.rowLines[from], starts, startCount * sizeof(int));
+    for (int row = from + startCount; row < rowCount; row++) {
+        state.rowLines[row] += shift;
+    }
+    state.rowCount = rowCount;
+    state.rowLines[rowCount] = state.lineCount;
+    free(starts);
+}
+
+/* ":collapse" collapses runs of equal lines, ":collapse mask" runs of lines equal but for numbers. */
+void collapseCommand(const char *argument) {
+    int mode = argument != NULL && strcmp(argument, "mask") == 0 ? COLLAPSE_MASKED : COLLAPSE_EXACT;
+    int line = editorRowLine(state.lineOffset);
+    state.collapse = state.collapse == mode ? COLLAPSE_OFF : mode;
+    state.selection.active = 0;
+    collapseBuild();
+
+    // keep the same line at the top of the screen
+    state.lineOffset = line;
+    if (state.collapse != COLLAPSE_OFF) {
+        int low = 0, high = state.rowCount;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (state.rowLines[middle + 1] <= line) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        state.lineOffset = low;
+    }
+
+    char message[96];
+    if (state.collapse == COLLAPSE_OFF) {
+        snprintf(message, sizeof(message), "showing all %d lines", state.lineCount);
+    } else {
+        snprintf(message, sizeof(message), "%d lines collapsed into %d rows", state.lineCount, state.rowCount);
+    }
+    editorSetStatusMessage(message);
+}
+
+/** FILTER *******************************************************************/
+
+/*
+ * Pipes lines through a shell command and puts its output in their place, like vim's "!".
+ * The input is fed and the output drained in one poll() loop, so a command that
+ * writes before it has read everything cannot deadlock against us.
+ * Output lines go straight into line storage; only a partial last line is buffered.
+ * Once the output would take the text in memory past the budget, further lines
+ * go to the spill file instead, through a buffer, and arrive already dropped.
+ * The terminal is watched too: ESC or Ctrl-C stops the command, and so does
+ * output past FILTER_OUTPUT_MAX, and the lines are left as they were.
+ */
+
+#define FILTER_CHUNK (64 * 1024)
+#define FILTER_OUTPUT_MAX (1LL << 30) // bytes of output; a command that writes more (yes, tail -f) is stopped
+#define FILTER_LINES_MAX (1 << 25)    // lines of output, as each costs a struct Line in memory too
+
+struct SpillRange {
+    long long from;
+    long long to;
+};
+
+struct FilterOutput {
+    struct Line *lines;
+    int count;
+    int capacity;
+    char *partial; // the line being received, not terminated yet
+    int partialLength;
+    int partialCapacity;
+    long long held;      // bytes of output text in memory
+    long long received;  // bytes of output in all
+    char *spill;         // output text on its way to the spill file
+    int spillLength;
+    long long spillPosition; // where the spill buffer goes
+    struct SpillRange *ranges; // of the spill file taken by the output, freed again if the command is stopped
+    int rangeCount;
+};
+
+void filterSpillFlush(struct FilterOutput *output) {
+    if (pwriteFully(memory.spill, output->spill, output->spillLength, output->spillPosition) == -1) {
+        die("failed to write the spill file");
+    }
+    output->spillPosition += output->spillLength;
+    output->spillLength = 0;
+}
+
+/* Moves the text of an output line to the spill file. */
+void filterSpill(struct FilterOutput *output, struct Line *line) {
+    if (output->spill == NULL) {
+        output->spill = malloc(IO_CHUNK);
+    }
+    if (output->rangeCount == 0 || output->ranges[output->rangeCount - 1].to != memory.spillEnd) {
+        filterSpillFlush(output); // the spill file grew in between
+        output->spillPosition = memory.spillEnd;
+        output->ranges = realloc(output->ranges, (output->rangeCount + 1) * sizeof(struct SpillRange));
+        output->ranges[output->rangeCount].from = output->ranges[output->rangeCount].to = memory.spillEnd;
+        output->rangeCount++;
+    } else if (output->spillLength + line->length > IO_CHUNK) {
+        filterSpillFlush(output);
+    }
+    if (line->length > IO_CHUNK) {
+        if (pwriteFully(memory.spill, line->chars, line->length, memory.spillEnd) == -1) {
+            die("failed to write the spill file");
+        }
+        output->spillPosition += line->length;
+    } else {
+        memcpy(&output->spill[output->spillLength], line->chars, line->length);
+        output->spillLength += line->length;
+    }
+    line->spilled = memory.spillEnd;
+    memory.spillEnd += line->length;
+    output->ranges[output->rangeCount - 1].to = memory.spillEnd;
+    lineRelease(line);
+}
+
+/* Throws the output away, giving back the space it took in the spill file. */
+void filterDiscard(struct FilterOutput *output) {
+    for (int i = 0; i < output->count; i++) {
+        lineRelease(&output->lines[i]);
+    }
+    for (int i = output->rangeCount - 1; i >= 0; i--) {
+        struct SpillRange *range = &output->ranges[i];
+        if (range->to == memory.spillEnd) {
+            memory.spillEnd = range->from; // the end of the file, which can simply be cut off
+            ftruncate(memory.spill, range->from);
+        } else {
+            fallocate(memory.spill, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range->from, range->to - range->from);
+        }
+    }
+    output->count = 0;
+    output->spillLength = 0;
+}
+
+void filterAddLine(struct FilterOutput *output, const char *chars, int length) {
+    if (output->count == output->capacity) {
+        output->capacity = output->capacity ? 2 * output->capacity : 1024;
+        output->lines = realloc(output->lines, output->capacity * sizeof(struct Line));
+    }
+    int returns = length > 0 && chars[length - 1] == '\r';
+    struct Line *line = &output->lines[output->count++];
+    lineInit(line, chars, length - returns);
+    line->returns = returns; // CRLF output is saved as CRLF
+    if (memory.budget != 0 && memory.used + output->held + line->length + 1 > memory.budget && memorySpillOpen() == 0) {
+        filterSpill(output, line);
+    } else {
+        output->held += line->length + 1;
+    }
+}
+
+void filterAddPartial(struct FilterOutput *output, const char *chars, int length) {
+    if (output->partialLength + length > output->partialCapacity) {
+        output->partialCapacity = max(2 * output->partialCapacity, output->partialLength + length);
+        output->partial = realloc(output->partial, output->partialCapacity);
+    }
+    memcpy(&output->partial[output->partialLength], chars, length);
+    output->partialLength += length;
+}
+
+void filterConsume(struct FilterOutput *output, const char *data, int length) {
+    const char *end = data + length;
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        if (newline == NULL) {
+            filterAddPartial(output, data, end - data);
+            return;
+        }
+        if (output->partialLength > 0) {
+            filterAddPartial(output, data, newline - data);
+            filterAddLine(output, output->partial, output->partialLength);
+            output->partialLength = 0;
+        } else {
+            filterAddLine(output, data, newline - data);
+        }
+        data = newline + 1;
+    }
+}
+
+/* Starts sh -c command; its stdout and stderr both go to the output pipe. */
+pid_t filterStart(const char *command, int *input, int *output) {
+    int in[2], out[2];
+    if (pipe(in) == -1) {
+        return -1;
+    }
+    if (pipe(out) == -1) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0); // a group of its own, so that stopping it stops a whole pipeline
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid == -1) {
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    *input = in[1];
+    *output = out[0];
+    return pid;
+}
+
+void editorFilterLines(const char *command) {
+    int first, last;
+    editorCommandRange(&first, &last);
+    if (last < first && state.lineCount > 0) {
+        editorSetStatusMessage("no lines selected");
+        return;
+    }
+
+    int input, output;
+    void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN); // the command may stop reading early
+    pid_t pid = filterStart(command, &input, &output);
+    if (pid == -1) {
+        signal(SIGPIPE, sigpipe);
+        editorSetStatusMessage("failed to start the command");
+        return;
+    }
+
+    editorSetStatusMessage("filtering, ESC or Ctrl-C to stop");
+    editorRefreshScreen();
+
+    struct FilterOutput result = { NULL, 0, 0, NULL, 0, 0, 0, 0, NULL, 0, 0, NULL, 0 };
+    const char *stopped = NULL; // why the command was stopped
+    int terminal = STDIN_FILENO; // watched for keys that stop the command
+    char *chunk = malloc(FILTER_CHUNK);
+    int chunkLength = 0, chunkPosition = 0;
+    int next = first, offset = 0; // next byte to send: line next, byte offset; offset == length is its '\n'
+
+    while (output != -1 && stopped == NULL) {
+        if (input != -1 && chunkPosition == chunkLength) {
+            chunkLength = chunkPosition = 0;
+            while (chunkLength < FILTER_CHUNK && next <= last) {
+                struct Line *line = &state.lines[next];
+                int n = min(line->length - offset, FILTER_CHUNK - chunkLength);
+                memcpy(&chunk[chunkLength], &lineChars(line)[offset], n);
+                chunkLength += n;
+                offset += n;
+                if (offset == line->length && chunkLength < FILTER_CHUNK) {
+                    chunk[chunkLength++] = '\n';
+                    next++;
+                    offset = 0;
+                }
+            }
+            memoryEnforce();
+            if (chunkLength == 0) {
+                close(input); // everything is sent, the command sees EOF
+                input = -1;
+            }
+        }
+
+        struct pollfd fds[3] = {
+            { output, POLLIN, 0 },
+            { input, POLLOUT, 0 }, // a negative fd is ignored by poll()
+            { terminal, POLLIN, 0 },
+        };
+        if (!inputPending() && poll(fds, 3, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (inputPending() || (fds[2].revents & (POLLIN | POLLHUP | POLLERR))) {
+            int interrupted = inputInterrupted();
+            if (interrupted == 1) {
+                stopped = "stopped";
+            } else if (interrupted == -1) {
+                terminal = -1;
+            }
+        }
+        if (fds[1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+            int n = write(input, &chunk[chunkPosition], chunkLength - chunkPosition);
+            if (n > 0) {
+                chunkPosition += n;
+            } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                close(input); // the command does not want more input
+                input = -1;
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            char buffer[FILTER_CHUNK];
+            int n = read(output, buffer, sizeof(buffer));
+            if (n > 0) {
+                filterConsume(&result, buffer, n);
+                result.received += n;
+                if (result.received > FILTER_OUTPUT_MAX || result.count > FILTER_LINES_MAX) {
+                    stopped = "stopped, too much output";
+                }
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                close(output);
+                output = -1;
+            }
+        }
+    }
+    if (stopped != NULL) {
+        kill(-pid, SIGTERM);
+        kill(-pid, SIGCONT); // one that read the terminal is stopped, and only takes the signal when running
+    }
+    if (input != -1) {
+        close(input);
+    }
+    if (output != -1) {
+        close(output);
+    }
+    if (result.partialLength > 0 && stopped == NULL) {
+        filterAddLine(&result, result.partial, result.partialLength);
+    }
+    free(result.partial);
+    if (result.spill != NULL) {
+        filterSpillFlush(&result);
+        free(result.spill);
+    }
+    free(chunk);
+
+    int status = 0;
+    pid_t reaped = 0;
+    if (stopped != NULL) {
+        for (int i = 0; i < 100 && (reaped = waitpid(pid, &status, WNOHANG)) == 0; i++) {
+            usleep(10 * 1000);
+        }
+        if (reaped == 0) {
+            kill(-pid, SIGKILL); // a second is all a command that ignores SIGTERM gets
+        }
+    }
+    if (reaped == 0) {
+        waitpid(pid, &status, 0);
+    }
+    signal(SIGPIPE, sigpipe);
+
+    char message[128];
+    if (stopped != NULL) {
+        filterDiscard(&result);
+        free(result.lines);
+        free(result.ranges);
+        snprintf(message, sizeof(message), "filter %s, the lines are unchanged", stopped);
+        editorSetStatusMessage(message);
+        return;
+    }
+    editorReplaceLines(first, last - first + 1, result.lines, result.count);
+    free(result.lines);
+    free(result.ranges);
+
+    snprintf(message, sizeof(message), "filtered %d lines into %d lines, exit status %d",
+        last - first + 1, result.count, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    editorSetStatusMessage(message);
+}
+
+/** SAVING *******************************************************************/
+
+/*
+ * Lines that still read exactly as they do in the opened file, ending
+ * included, are written as runs straight from the source file by the kernel
+ * with copy_file_range (or sendfile where that is not possible). Only lines
+ * that came from elsewhere pass through a buffer in user space. Each line gets
+ * the ending it was read with ('\n' for new ones), so saving an unedited file
+ * writes it back byte for byte. The file is written
+ * to a temporary name next to it and renamed into place at the end, so saving
+ * over the opened file keeps the source readable until the very last moment.
+ */
+
+#define SAVE_COPY_MIN (16 * 1024) // shorter runs are cheaper to write from memory than to copy with a system call
+
+/*
+ * Buffered lines are written at explicit offsets, through the ring when there
+ * is one, so that up to IO_DEPTH buffers are on their way to the file while
+ * the next one fills up.
+ */
+struct SaveOutput {
+    int fd;
+    struct Ring ring;
+    char *buffers[IO_DEPTH];
+    int lengths[IO_DEPTH];          // of the write in flight from each buffer, 0 if none
+    long long positions[IO_DEPTH];  // and where it goes
+    int current;
+    int length;         // filled in the current buffer
+    long long position; // where the current buffer goes
+    long long released; // the output before this is on disk and out of the cache
+    int error;          // errno of a failed write
+    long long written;
+    long long copied; // by the kernel
+};
+
+void saveInit(struct SaveOutput *output, int fd) {
+    output->fd = fd;
+    for (int slot = 0; slot < IO_DEPTH; slot++) {
+        if (posix_memalign((void **) &output->buffers[slot], 4096, IO_CHUNK) != 0) {
+            die("posix_memalign");
+        }
+        output->lengths[slot] = 0;
+    }
+    output->current = output->length = 0;
+    output->position = output->written = output->copied = output->released = 0;
+    output->error = 0;
+    ringInit(&output->ring, IO_DEPTH);
+}
+
+/* Waits for one write to complete, finishing it with pwrite if it came up short. */
+void saveComplete(struct SaveOutput *output) {
+    int slot;
+    int result = ringWait(&output->ring, &slot);
+    if (slot == -1) {
+        output->error = -result; // the save fails, whatever the writes in flight do
+        if (ringDestroy(&output->ring) == -1) {
+            // they may still be reading their buffers: leave those to them
+            for (int i = 0; i < IO_DEPTH; i++) {
+                if (posix_memalign((void **) &output->buffers[i], 4096, IO_CHUNK) != 0) {
+                    die("posix_memalign");
+                }
+            }
+        }
+        return;
+    }
+    int done = max(result, 0); // also when the kernel does not know IORING_OP_WRITE
+    if (done < output->lengths[slot]
+            && pwriteFully(output->fd, &output->buffers[slot][done], output->lengths[slot] - done, output->positions[slot] + done) == -1) {
+        output->error = errno;
+    }
+    output->lengths[slot] = 0;
+}
+
+/*
+ * Once the output is big enough to matter, writes it back and drops it from
+ * the cache as it grows, one window behind where the writes are in flight.
+ */
+void saveDropBehind(struct SaveOutput *output) {
+    if (output->position < CACHE_DROP_BEHIND_MIN) {
+        return;
+    }
+    long long end = (output->position / CACHE_WINDOW - 1) * CACHE_WINDOW;
+    if (end > output->released) {
+        sync_file_range(output->fd, output->released, end - output->released,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        cacheRelease(output->fd, output->released, end - output->released);
+        output->released = end;
+    }
+}
+
+int saveFlush(struct SaveOutput *output) {
+    if (output->length > 0) {
+        int slot = output->current;
+        if (output->ring.fd != -1) {
+            output->lengths[slot] = output->length;
+            output->positions[slot] = output->position;
+            ringQueue(&output->ring, 1, output->fd, output->buffers[slot], output->length, output->position, slot);
+            output->current = (slot + 1) % IO_DEPTH;
+            while (output->ring.fd != -1 && output->lengths[output->current] != 0) {
+                saveComplete(output);
+            }
+        } else if (pwriteFully(output->fd, output->buffers[slot], output->length, output->position) == -1) {
+            output->error = errno;
+        }
+        output->position += output->length;
+        output->length = 0;
+        saveDropBehind(output);
+    }
+    if (output->error != 0) {
+        errno = output->error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Waits for every write in flight, then lets go of the buffers. */
+int saveFinish(struct SaveOutput *output) {
+    int result = saveFlush(output);
+    for (int slot = 0; slot < IO_DEPTH; slot++) {
+        while (output->ring.fd != -1 && output->lengths[slot] != 0) {
+            saveComplete(output);
+        }
+    }
+    ringDestroy(&output->ring);
+    for (int slot = 0; slot < IO_DEPTH; slot++) {
+        free(output->buffers[slot]);
+    }
+    if (result == 0 && output->error != 0) {
+        errno = output->error;
+        result = -1;
+    }
+    return result;
+}
+
+int saveAppend(struct SaveOutput *output, const char *data, int length) {
+    while (length > 0) {
+        if (output->length == IO_CHUNK && saveFlush(output) == -1) {
+            return -1;
+        }
+        int n = min(length, IO_CHUNK - output->length);
+        memcpy(&output->buffers[output->current][output->length], data, n);
+        output->length += n;
+        output->written += n;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* Copies length bytes at offset of the source file to the output. */
+int saveCopy(struct SaveOutput *output, long long offset, long long length) {
+    if (saveFlush(output) == -1) {
+        return -1;
+    }
+    output->written += length;
+    off_t from = offset;
+    off_t to = output->position;
+    while (length > 0) {
+        ssize_t n = copy_file_range(state.source, &from, output->fd, &to, length, 0);
+        if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+            lseek(output->fd, to, SEEK_SET);
+            n = sendfile(output->fd, state.source, &from, length);
+            to += n > 0 ? n : 0;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            break; // neither works between these files
+        }
+        if (n <= 0) {
+            return -1; // the source got shorter under us, or a real error
+        }
+        output->copied += n;
+        length -= n;
+    }
+    if (to >= CACHE_DROP_BEHIND_MIN) {
+        cacheRelease(state.source, offset, from - offset);
+    }
+    output->position = to;
+    saveDropBehind(output);
+    while (length > 0) {
+        long n = preadFully(state.source, output->buffers[output->current], min(length, IO_CHUNK), from);
+        if (n <= 0) {
+            return -1;
+        }
+        output->length = n;
+        if (saveFlush(output) == -1) {
+            return -1;
+        }
+        from += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* Writes the ending of the line; a line without '\n' gets one unless it is the last written. */
+int saveEnding(struct SaveOutput *output, const struct Line *line, int last) {
+    char ending[256];
+    memset(ending, '\r', line->returns);
+    int length = line->returns;
+    if (line->newline || !last) {
+        ending[length++] = '\n';
+    }
+    return saveAppend(output, ending, length);
+}
+
+/* Writes lines [first, last] to the file, each with its ending; returns 0 or -1 with errno set. */
+int saveLines(const char *filename, int first, int last, long long *written, long long *copied) {
+    char *temporary = malloc(strlen(filename) + 8);
+    sprintf(temporary, "%s.XXXXXX", filename);
+    struct SaveOutput *output = malloc(sizeof(struct SaveOutput));
+    saveInit(output, mkstemp(temporary));
+    int result = output->fd == -1 ? -1 : 0;
+
+    int i = first;
+    while (result == 0 && i <= last) {
+        memoryEnforce();
+        // the longest run of lines that follow each other in the source
+        int next = i + 1;
+        long long start = state.lines[i].offset;
+        long long end = start + state.lines[i].length + state.lines[i].returns + state.lines[i].newline;
+        if (start != -1 && state.source != -1) {
+            for (; next <= last && state.lines[next].offset == end; next++) {
+                end += state.lines[next].length + state.lines[next].returns + state.lines[next].newline;
+            }
+        }
+        if (start != -1 && state.source != -1 && end - start >= SAVE_COPY_MIN) {
+            result = saveCopy(output, start, end - start);
+            if (result == 0 && !state.lines[next - 1].newline && next <= last) {
+                result = saveAppend(output, "\n", 1); // the file's last line, but not the last one written
+            }
+        } else {
+            for (; i < next && result == 0; i++) {
+                if (saveAppend(output, lineChars(&state.lines[i]), state.lines[i].length) == -1 || saveEnding(output, &state.lines[i], i == last) == -1) {
+                    result = -1;
+                }
+            }
+        }
+        i = next;
+    }
+    if (saveFinish(output) == -1) {
+        result = -1;
+    }
+
+    if (output->fd != -1) {
+        struct stat status;
+        if (result == 0 && stat(filename, &status) == 0) {
+            fchmod(output->fd, status.st_mode & 07777); // mkstemp creates 0600
+        } else if (result == 0) {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(output->fd, 0666 & ~mask);
+        }
+        if (close(output->fd) == -1 || result == -1 || rename(temporary, filename) == -1) {
+            int error = errno;
+            unlink(temporary);
+            errno = error;
+            result = -1;
+        }
+    }
+    *written = output->written;
+    *copied = output->copied;
+    free(output);
+    free(temporary);
+    return result;
+}
+
+void editorSave(const char *filename, int first, int last) {
+    char message[256];
+    long long written, copied;
+    if (saveLines(filename, first, last, &written, &copied) == -1) {
+        snprintf(message, sizeof(message), "failed to write %s: %s", filename, strerror(errno));
+    } else {
+        snprintf(message, sizeof(message), "wrote %d lines, %lld bytes (%lld copied by the kernel) to %s",
+            last - first + 1, written, copied, filename);
+    }
+    editorSetStatusMessage(message);
+}
+
+/* ":w" saves, ":w file" saves as, ":wr file" writes the selected lines. */
+void editorWriteCommand(const char *command) {
+    const char *argument = strchr(command, ' ');
+    while (argument != NULL && *argument == ' ') {
+        argument++;
+    }
+    if (argument != NULL && *argument == '\0') {
+        argument = NULL;
+    }
+
+    if (command[1] == 'r') {
+        if (argument == NULL) {
+            editorSetStatusMessage("usage: wr file");
+            return;
+        }
+        int first, last;
+        editorCommandRange(&first, &last);
+        if (last < first) {
+            editorSetStatusMessage("no lines selected");
+            return;
+        }
+        editorSave(argument, first, last);
+        return;
+    }
+    if (argument != NULL) {
+        free(state.filename);
+        state.filename = strdup(argument);
+    } else if (state.filename == NULL) {
+        editorSetStatusMessage("usage: w file");
+        return;
+    }
+    editorSave(state.filename, 0, state.lineCount - 1);
+}
+
+/** MINIMAP ******************************************************************/
+
+/*
+ * An overview of the whole file in the last screen column: how long the lines
+ * are on average (shade), where lines run past the screen (bold) and where the
+ * viewport is (reverse video).
+ * Lines are summarized per block of MINIMAP_BLOCK; a segment tree over the
+ * blocks answers any range in O(log blocks), and only the lines in the two
+ * partial blocks at the ends of a range are looked at one by one. An edit
+ * recomputes the blocks it touched, so drawing never depends on the file size.
+ */
+
+#define MINIMAP_BLOCK 1024
+
+struct Minimap {
+    int enabled;
+    int blocks;
+    int size; // leaves of the tree, a power of two
+    long long *sum; // total length of the lines below each node
+    int *longest;   // length of the longest line below each node
+} minimap;
+
+void minimapSetBlock(int block) {
+    long long sum = 0;
+    int longest = 0;
+    int end = min(state.lineCount, (block + 1) * MINIMAP_BLOCK);
+    for (int i = block * MINIMAP_BLOCK; i < end; i++) {
+        sum += state.lines[i].length;
+        longest = max(longest, state.lines[i].length);
+    }
+    minimap.sum[minimap.size + block] = sum;
+    minimap.longest[minimap.size + block] = longest;
+}
+
+void minimapCombine(int node) {
+    minimap.sum[node] = minimap.sum[2 * node] + minimap.sum[2 * node + 1];
+    minimap.longest[node] = max(minimap.longest[2 * node], minimap.longest[2 * node + 1]);
+}
+
+void minimapBuild() {
+    free(minimap.sum);
+    free(minimap.longest);
+    minimap.blocks = (state.lineCount + MINIMAP_BLOCK - 1) / MINIMAP_BLOCK;
+    minimap.size = 1;
+    while (minimap.size < minimap.blocks) {
+        minimap.size *= 2;
+    }
+    minimap.sum = calloc(2 * minimap.size, sizeof(long long));
+    minimap.longest = calloc(2 * minimap.size, sizeof(int));
+    for (int block = 0; block < minimap.blocks; block++) {
+        minimapSetBlock(block);
+    }
+    for (int node = minimap.size - 1; node > 0; node--) {
+        minimapCombine(node);
+    }
+}
+
+/* Brings the summaries up to date after count lines at first were replaced by newCount lines. */
+void minimapUpdate(int first, int count, int newCount) {
+    if (!minimap.enabled) {
+        return;
+    }
+    int blocks = (state.lineCount + MINIMAP_BLOCK - 1) / MINIMAP_BLOCK;
+    if (blocks > minimap.size) {
+        minimapBuild();
+        return;
+    }
+    // lines after the edit move to other blocks unless the count stays the same
+    int firstBlock = first / MINIMAP_BLOCK;
+    int lastBlock = count == newCount ? (first + newCount - 1) / MINIMAP_BLOCK : max(blocks, minimap.blocks) - 1;
+    for (int block = firstBlock; block <= lastBlock; block++) {
+        minimapSetBlock(block);
+        for (int node = (minimap.size + block) / 2; node > 0; node /= 2) {
+            minimapCombine(node);
+        }
+    }
+    minimap.blocks = blocks;
+}
+
+void minimapToggle() {
+    minimap.enabled = !minimap.enabled;
+    if (minimap.enabled) {
+        minimapBuild();
+    }
+}
+
+/* Total and maximum length of the lines [from, to). */
+void minimapQuery(int from, int to, long long *sum, int *longest) {
+    *sum = 0;
+    *longest = 0;
+    int firstBlock = (from + MINIMAP_BLOCK - 1) / MINIMAP_BLOCK;
+    int lastBlock = to / MINIMAP_BLOCK; // blocks [firstBlock, lastBlock) lie entirely inside
+    if (firstBlock >= lastBlock) {
+        firstBlock = lastBlock = to / MINIMAP_BLOCK;
+    }
+    for (int i = from; i < min(to, firstBlock * MINIMAP_BLOCK); i++) {
+        *sum += state.lines[i].length;
+        *longest = max(*longest, state.lines[i].length);
+    }
+    for (int i = max(from, lastBlock * MINIMAP_BLOCK); i < to; i++) {
+        *sum += state.lines[i].length;
+        *longest = max(*longest, state.lines[i].length);
+    }
+    for (int left = minimap.size + firstBlock, right = minimap.size + lastBlock; left < right; left /= 2, right /= 2) {
+        if (left & 1) {
+            *sum += minimap.sum[left];
+            *longest = max(*longest, minimap.longest[left++]);
+        }
+        if (right & 1) {
+            *sum += minimap.sum[--right];
+            *longest = max(*longest, minimap.longest[right]);
+        }
+    }
+}
+
+/* Appends the minimap cell for screen row y, in the last column. */
+void minimapDrawRow(int y) {
+    static const char *shades[] = { " ", "░", "▒", "▓", "█" };
+    if (!minimap.enabled) {
+        return;
+    }
+    long long from = (long long) y * state.lineCount / state.rows;
+    long long to = (long long) (y + 1) * state.lineCount / state.rows;
+    if (to == from) {
+        to = min(from + 1, state.lineCount); // fewer lines than rows
+    }
+    if (from >= state.lineCount) {
+        return;
+    }
+    char position[16];
+    backBufferAppend(position, snprintf(position, sizeof(position), ESC "[%dG", state.columns));
+    long long sum;
+    int longest;
+    minimapQuery(from, to, &sum, &longest);
+
+    int width = state.columns - 1; // the text shown of a line
+    int shade = sum == 0 ? 0 : min(4, 1 + (int) (sum * 4 / (width * (to - from))));
+    int visible = from < editorRowLine(state.lineOffset + state.rows) && to > editorRowLine(state.lineOffset);
+    int clipped = longest > width;
+    if (visible) {
+        backBufferAppend(ESC "[7m", 4);
+    }
+    if (clipped) {
+        backBufferAppend(ESC "[1m", 4);
+    }
+    backBufferAppend(shades[shade], strlen(shades[shade]));
+    if (visible || clipped) {
+        backBufferAppend(ESC "[m", 3);
+    }
+}
+
+/** TERMINAL PANE ************************************************************/
+
+/*
+ * A shell on a local pty in the lower half of the screen.
+ * Its output goes through a table-driven VT parser: bytes are classified once
+ * through a 256-entry table and every (state, class) pair has a precomputed
+ * action and next state. Runs of printable ASCII skip the table altogether.
+ * Lines that scroll off the top are kept as struct Line, like buffer lines.
+ * Only the damaged span of each row is redrawn when the shell writes.
+ */
+
+#define PANE_SCROLLBACK 10000
+#define PANE_READ_BUDGET (256 * 1024) // output bytes handled per loop iteration, so keys are not kept waiting
+#define PANE_FRAME_MS 16 // the pane alone is repainted at most ~60 times per second
+#define PANE_MAX_PARAMS 16
+
+enum VtState {
+    VT_GROUND,
+    VT_ESCAPE,
+    VT_ESCAPE_INTERMEDIATE,
+    VT_CSI_ENTRY,
+    VT_CSI_PARAM,
+    VT_CSI_INTERMEDIATE,
+    VT_CSI_IGNORE,
+    VT_STRING, // OSC and DCS, ignored up to BEL or ST
+    VT_STATES
+};
+
+enum VtClass {
+    VT_C_CONTROL,      // C0 controls, executed in any state
+    VT_C_CANCEL,       // CAN, SUB
+    VT_C_ESCAPE,
+    VT_C_BELL,         // executed, but also ends a string
+    VT_C_INTERMEDIATE, // 0x20-0x2f
+    VT_C_DIGIT,        // 0-9
+    VT_C_SEPARATOR,    // ; and :
+    VT_C_PRIVATE,      // < = > ?
+    VT_C_CSI,          // [
+    VT_C_STRING,       // ] and P, start OSC and DCS
+    VT_C_FINAL,        // the rest of 0x40-0x7e
+    VT_C_DELETE,       // 0x7f
+    VT_C_HIGH,         // 0x80-0xff, UTF-8
+    VT_CLASSES
+};
+
+enum VtAction {
+    VT_NONE,
+    VT_PRINT,
+    VT_EXECUTE,
+    VT_CLEAR,
+    VT_COLLECT,
+    VT_PARAM,
+    VT_ESC_DISPATCH,
+    VT_CSI_DISPATCH
+};
+
+struct VtTransition {
+    unsigned char action;
+    unsigned char next;
+};
+
+unsigned char vtClass[256];
+struct VtTransition vtTable[VT_STATES][VT_CLASSES];
+
+struct Pane {
+    int open;
+    int focused;
+    int fd;
+    pid_t pid;
+
+    int top; // screen row of the title bar, the cells follow below it
+    int rows, columns;
+    unsigned int *cells; // code points
+    int cursorRow, cursorColumn;
+    int wrapPending; // the last column was written, the next character wraps
+    int savedRow, savedColumn;
+    int scrollTop, scrollBottom; // scroll region, inclusive
+
+    int vtState;
+    int params[PANE_MAX_PARAMS];
+    int paramCount;
+    char intermediate; // first intermediate or private marker byte
+    unsigned int utf8; // code point being decoded
+    int utf8Remaining;
+
+    int *damageFrom, *damageTo; // damaged columns [from, to) of each row
+    int damaged;
+    long lastRender; // ms
+
+    struct Line *scrollback; // ring buffer
+    int scrollbackStart, scrollbackCount;
+    int scroll; // lines scrolled back
+} pane;
+
+long nowMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+int utf8Encode(unsigned int codepoint, char *out) {
+    if (codepoint < 0x80) {
+        out[0] = codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        out[0] = 0xc0 | (codepoint >> 6);
+        out[1] = 0x80 | (codepoint & 0x3f);
+        return 2;
+    } else if (codepoint < 0x10000) {
+        out[0] = 0xe0 | (codepoint >> 12);
+        out[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+        out[2] = 0x80 | (codepoint & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (codepoint >> 18);
+    out[1] = 0x80 | ((codepoint >> 12) & 0x3f);
+    out[2] = 0x80 | ((codepoint >> 6) & 0x3f);
+    out[3] = 0x80 | (codepoint & 0x3f);
+    return 4;
+}
+
+void vtSet(int state, int class, int action, int next) {
+    vtTable[state][class].action = action;
+    vtTable[state][class].next = next;
+}
+
+void vtInit() {
+    for (int c = 0; c < 256; c++) {
+        if (c < 0x20) {
+            vtClass[c] = VT_C_CONTROL;
+        } else if (c < 0x30) {
+            vtClass[c] = VT_C_INTERMEDIATE;
+        } else if (c < 0x3a) {
+            vtClass[c] = VT_C_DIGIT;
+        } else if (c < 0x3c) {
+            vtClass[c] = VT_C_SEPARATOR;
+        } else if (c < 0x40) {
+            vtClass[c] = VT_C_PRIVATE;
+        } else if (c < 0x7f) {
+            vtClass[c] = VT_C_FINAL;
+        } else if (c == 0x7f) {
+            vtClass[c] = VT_C_DELETE;
+        } else {
+            vtClass[c] = VT_C_HIGH;
+        }
+    }
+    vtClass[0x07] = VT_C_BELL;
+    vtClass[0x18] = VT_C_CANCEL;
+    vtClass[0x1a] = VT_C_CANCEL;
+    vtClass[0x1b] = VT_C_ESCAPE;
+    vtClass['['] = VT_C_CSI;
+    vtClass[']'] = VT_C_STRING;
+    vtClass['P'] = VT_C_STRING;
+
+    // rules that hold in every state, refined below
+    for (int state = 0; state < VT_STATES; state++) {
+        for (int class = 0; class < VT_CLASSES; class++) {
+            vtSet(state, class, VT_NONE, state);
+        }
+        vtSet(state, VT_C_CONTROL, VT_EXECUTE, state);
+        vtSet(state, VT_C_BELL, VT_EXECUTE, state);
+        vtSet(state, VT_C_CANCEL, VT_NONE, VT_GROUND);
+        vtSet(state, VT_C_ESCAPE, VT_CLEAR, VT_ESCAPE);
+    }
+
+    for (int class = VT_C_INTERMEDIATE; class <= VT_C_FINAL; class++) {
+        vtSet(VT_GROUND, class, VT_PRINT, VT_GROUND);
+    }
+    vtSet(VT_GROUND, VT_C_HIGH, VT_PRINT, VT_GROUND);
+
+    for (int class = VT_C_DIGIT; class <= VT_C_FINAL; class++) {
+        vtSet(VT_ESCAPE, class, VT_ESC_DISPATCH, VT_GROUND);
+        vtSet(VT_ESCAPE_INTERMEDIATE, class, VT_ESC_DISPATCH, VT_GROUND);
+    }
+    vtSet(VT_ESCAPE, VT_C_INTERMEDIATE, VT_COLLECT, VT_ESCAPE_INTERMEDIATE);
+    vtSet(VT_ESCAPE, VT_C_CSI, VT_CLEAR, VT_CSI_ENTRY);
+    vtSet(VT_ESCAPE, VT_C_STRING, VT_NONE, VT_STRING);
+    vtSet(VT_ESCAPE_INTERMEDIATE, VT_C_INTERMEDIATE, VT_COLLECT, VT_ESCAPE_INTERMEDIATE);
+
+    int csi[] = { VT_CSI_ENTRY, VT_CSI_PARAM, VT_CSI_INTERMEDIATE };
+    for (int i = 0; i < 3; i++) {
+        vtSet(csi[i], VT_C_FINAL, VT_CSI_DISPATCH, VT_GROUND);
+        vtSet(csi[i], VT_C_CSI, VT_CSI_DISPATCH, VT_GROUND);
+        vtSet(csi[i], VT_C_STRING, VT_CSI_DISPATCH, VT_GROUND);
+        vtSet(csi[i], VT_C_INTERMEDIATE, VT_COLLECT, VT_CSI_INTERMEDIATE);
+    }
+    vtSet(VT_CSI_ENTRY, VT_C_DIGIT, VT_PARAM, VT_CSI_PARAM);
+    vtSet(VT_CSI_ENTRY, VT_C_SEPARATOR, VT_PARAM, VT_CSI_PARAM);
+    vtSet(VT_CSI_ENTRY, VT_C_PRIVATE, VT_COLLECT, VT_CSI_PARAM);
+    vtSet(VT_CSI_PARAM, VT_C_DIGIT, VT_PARAM, VT_CSI_PARAM);
+    vtSet(VT_CSI_PARAM, VT_C_SEPARATOR, VT_PARAM, VT_CSI_PARAM);
+    vtSet(VT_CSI_PARAM, VT_C_PRIVATE, VT_NONE, VT_CSI_IGNORE);
+    vtSet(VT_CSI_INTERMEDIATE, VT_C_DIGIT, VT_NONE, VT_CSI_IGNORE);
+    vtSet(VT_CSI_INTERMEDIATE, VT_C_SEPARATOR, VT_NONE, VT_CSI_IGNORE);
+    vtSet(VT_CSI_INTERMEDIATE, VT_C_PRIVATE, VT_NONE, VT_CSI_IGNORE);
+    vtSet(VT_CSI_IGNORE, VT_C_FINAL, VT_NONE, VT_GROUND);
+    vtSet(VT_CSI_IGNORE, VT_C_CSI, VT_NONE, VT_GROUND);
+    vtSet(VT_CSI_IGNORE, VT_C_STRING, VT_NONE, VT_GROUND);
+
+    // strings swallow everything up to BEL, or ESC \ which goes through VT_ESCAPE
+    for (int class = 0; class < VT_CLASSES; class++) {
+        vtSet(VT_STRING, class, VT_NONE, VT_STRING);
+    }
+    vtSet(VT_STRING, VT_C_BELL, VT_NONE, VT_GROUND);
+    vtSet(VT_STRING, VT_C_CANCEL, VT_NONE, VT_GROUND);
+    vtSet(VT_STRING, VT_C_ESCAPE, VT_CLEAR, VT_ESCAPE);
+}
+
+void paneDamage(int row, int from, int to) {
+    if (pane.damageFrom[row] == pane.damageTo[row]) {
+        pane.damageFrom[row] = from;
+        pane.damageTo[row] = to;
+    } else {
+        pane.damageFrom[row] = min(pane.damageFrom[row], from);
+        pane.damageTo[row] = max(pane.damageTo[row], to);
+    }
+    pane.damaged = 1;
+}
+
+void paneDamageAll() {
+    for (int row = 0; row < pane.rows; row++) {
+        paneDamage(row, 0, pane.columns);
+    }
+}
+
+void paneClearCells(int row, int from, int to) {
+    unsigned int *cells = &pane.cells[row * pane.columns];
+    for (int column = from; column < to; column++) {
+        cells[column] = ' ';
+    }
+    paneDamage(row, from, to);
+}
+
+void paneKeepLine(int row) {
+    unsigned int *cells = &pane.cells[row * pane.columns];
+    int length = pane.columns;
+    while (length > 0 && cells[length - 1] == ' ') {
+        length--;
+    }
+    char *chars = malloc(length * 4 + 1);
+    int bytes = 0;
+    for (int column = 0; column < length; column++) {
+        bytes += utf8Encode(cells[column], &chars[bytes]);
+    }
+
+    int slot = (pane.scrollbackStart + pane.scrollbackCount) % PANE_SCROLLBACK;
+    if (pane.scrollbackCount == PANE_SCROLLBACK) {
+        lineRelease(&pane.scrollback[slot]); // the oldest line makes room
+        pane.scrollbackStart = (pane.scrollbackStart + 1) % PANE_SCROLLBACK;
+    } else {
+        pane.scrollbackCount++;
+    }
+    lineInit(&pane.scrollback[slot], chars, bytes);
+    free(chars);
+}
+
+/* Scrolls the scroll region up (count > 0) or down (count < 0). */
+void paneScroll(int top, int count) {
+    int bottom = pane.scrollBottom;
+    int height = bottom - top + 1;
+    int n = min(abs(count), height);
+    int columns = pane.columns;
+    if (count > 0) {
+        if (top == 0 && bottom == pane.rows - 1) {
+            for (int row = 0; row < n; row++) {
+                paneKeepLine(row);
+            }
+        }
+        memmove(&pane.cells[top * columns], &pane.cells[(top + n) * columns], (height - n) * columns * sizeof(unsigned int));
+        for (int row = bottom - n + 1; row <= bottom; row++) {
+            paneClearCells(row, 0, columns);
+        }
+    } else {
+        memmove(&pane.cells[(top + n) * columns], &pane.cells[top * columns], (height - n) * columns * sizeof(unsigned int));
+        for (int row = top; row < top + n; row++) {
+            paneClearCells(row, 0, columns);
         }
     }
-    while (length < state.columns) {
+    for (int row = top; row <= bottom; row++) {
+        paneDamage(row, 0, columns);
+    }
+}
+
+void paneLineFeed() {
+    if (pane.cursorRow == pane.scrollBottom) {
+        paneScroll(pane.scrollTop, 1);
+    } else if (pane.cursorRow < pane.rows - 1) {
+        pane.cursorRow++;
+    }
+}
+
+void paneReverseLineFeed() {
+    if (pane.cursorRow == pane.scrollTop) {
+        paneScroll(pane.scrollTop, -1);
+    } else if (pane.cursorRow > 0) {
+        pane.cursorRow--;
+    }
+}
+
+void panePrint(unsigned int codepoint) {
+    if (pane.wrapPending) {
+        pane.cursorColumn = 0;
+        paneLineFeed();
+        pane.wrapPending = 0;
+    }
+    pane.cells[pane.cursorRow * pane.columns + pane.cursorColumn] = codepoint;
+    paneDamage(pane.cursorRow, pane.cursorColumn, pane.cursorColumn + 1);
+    if (pane.cursorColumn == pane.columns - 1) {
+        pane.wrapPending = 1;
+    } else {
+        pane.cursorColumn++;
+    }
+}
+
+void paneMoveCursor(int row, int column) {
+    pane.cursorRow = max(0, min(pane.rows - 1, row));
+    pane.cursorColumn = max(0, min(pane.columns - 1, column));
+    pane.wrapPending = 0;
+}
+
+void paneExecute(int c) {
+    switch (c) {
+    case '\b':
+        paneMoveCursor(pane.cursorRow, pane.cursorColumn - 1);
+        break;
+    case '\t':
+        paneMoveCursor(pane.cursorRow, (pane.cursorColumn / 8 + 1) * 8);
+        break;
+    case '\n':
+    case '\v':
+    case '\f':
+        paneLineFeed();
+        pane.wrapPending = 0;
+        break;
+    case '\r':
+        pane.cursorColumn = 0;
+        pane.wrapPending = 0;
+        break;
+    }
+}
+
+void paneReset() {
+    for (int row = 0; row < pane.rows; row++) {
+        paneClearCells(row, 0, pane.columns);
+    }
+    paneMoveCursor(0, 0);
+    pane.scrollTop = 0;
+    pane.scrollBottom = pane.rows - 1;
+    pane.savedRow = pane.savedColumn = 0;
+}
+
+void paneEscDispatch(int c) {
+    if (pane.intermediate != 0) {
+        return; // character sets and the like
+    }
+    switch (c) {
+    case 'D':
+        paneLineFeed();
+        break;
+    case 'E':
+        pane.cursorColumn = 0;
+        paneLineFeed();
+        break;
+    case 'M':
+        paneReverseLineFeed();
+        break;
+    case '7':
+        pane.savedRow = pane.cursorRow;
+        pane.savedColumn = pane.cursorColumn;
+        break;
+    case '8':
+        paneMoveCursor(pane.savedRow, pane.savedColumn);
+        break;
+    case 'c':
+        paneReset();
+        break;
+    }
+}
+
+int paneParam(int i, int defaultValue) {
+    return i < pane.paramCount && pane.params[i] > 0 ? pane.params[i] : defaultValue;
+}
+
+void paneCsiDispatch(int c) {
+    if (pane.intermediate != 0) {
+        return; // private modes (?25h etc.) and the like have no effect here
+    }
+    int row = pane.cursorRow;
+    int column = pane.cursorColumn;
+    int columns = pane.columns;
+    int n = paneParam(0, 1);
+    switch (c) {
+    case 'A': paneMoveCursor(row - n, column); break;
+    case 'B': case 'e': paneMoveCursor(row + n, column); break;
+    case 'C': case 'a': paneMoveCursor(row, column + n); break;
+    case 'D': paneMoveCursor(row, column - n); break;
+    case 'E': paneMoveCursor(row + n, 0); break;
+    case 'F': paneMoveCursor(row - n, 0); break;
+    case 'G': case '`': paneMoveCursor(row, n - 1); break;
+    case 'd': paneMoveCursor(n - 1, column); break;
+    case 'H': case 'f': paneMoveCursor(paneParam(0, 1) - 1, paneParam(1, 1) - 1); break;
+    case 'J':
+        switch (paneParam(0, 0)) {
+        case 0:
+            paneClearCells(row, column, columns);
+            for (int r = row + 1; r < pane.rows; r++) {
+                paneClearCells(r, 0, columns);
+            }
+            break;
+        case 1:
+            for (int r = 0; r < row; r++) {
+                paneClearCells(r, 0, columns);
+            }
+            paneClearCells(row, 0, column + 1);
+            break;
+        default:
+            for (int r = 0; r < pane.rows; r++) {
+                paneClearCells(r, 0, columns);
+            }
+        }
+        break;
+    case 'K':
+        switch (paneParam(0, 0)) {
+        case 0: paneClearCells(row, column, columns); break;
+        case 1: paneClearCells(row, 0, column + 1); break;
+        default: paneClearCells(row, 0, columns);
+        }
+        break;
+    case 'L':
+    case 'M':
+        if (row >= pane.scrollTop && row <= pane.scrollBottom) {
+            paneScroll(row, c == 'L' ? -n : n);
+        }
+        break;
+    case 'S': paneScroll(pane.scrollTop, n); break;
+    case 'T': paneScroll(pane.scrollTop, -n); break;
+    case '@':
+    case 'P': {
+        unsigned int *cells = &pane.cells[row * columns];
+        n = min(n, columns - column);
+        if (c == '@') {
+            memmove(&cells[column + n], &cells[column], (columns - column - n) * sizeof(unsigned int));
+            paneClearCells(row, column, column + n);
+        } else {
+            memmove(&cells[column], &cells[column + n], (columns - column - n) * sizeof(unsigned int));
+            paneClearCells(row, columns - n, columns);
+        }
+        paneDamage(row, column, columns);
+        break;
+    }
+    case 'X': paneClearCells(row, column, min(columns, column + n)); break;
+    case 'r': {
+        int top = paneParam(0, 1) - 1;
+        int bottom = paneParam(1, pane.rows) - 1;
+        if (top < bottom && bottom < pane.rows) {
+            pane.scrollTop = top;
+            pane.scrollBottom = bottom;
+            paneMoveCursor(0, 0);
+        }
+        break;
+    }
+    case 'n':
+        if (paneParam(0, 0) == 6) { // cursor position report
+            char report[32];
+            int length = snprintf(report, sizeof(report), ESC "[%d;%dR", row + 1, column + 1);
+            write(pane.fd, report, length);
+        }
+        break;
+    }
+}
+
+void paneFeed(const unsigned char *data, int length) {
+    int i = 0;
+    while (i < length) {
+        // fast path: a run of printable ASCII goes straight into the row
+        if (pane.vtState == VT_GROUND && data[i] >= 0x20 && data[i] < 0x7f) {
+            if (pane.wrapPending) {
+                panePrint(data[i++]);
+                continue;
+            }
+            unsigned int *cells = &pane.cells[pane.cursorRow * pane.columns];
+            int column = pane.cursorColumn;
+            int end = column;
+            while (i < length && end < pane.columns && data[i] >= 0x20 && data[i] < 0x7f) {
+                cells[end++] = data[i++];
+            }
+            paneDamage(pane.cursorRow, column, end);
+            if (end == pane.columns) {
+                pane.cursorColumn = pane.columns - 1;
+                pane.wrapPending = 1;
+            } else {
+                pane.cursorColumn = end;
+            }
+            continue;
+        }
+
+        int c = data[i++];
+        struct VtTransition transition = vtTable[pane.vtState][vtClass[c]];
+        pane.vtState = transition.next;
+        switch (transition.action) {
+        case VT_PRINT:
+            if (c < 0x80) {
+                pane.utf8Remaining = 0;
+                panePrint(c);
+            } else if ((c & 0xc0) == 0x80) {
+                if (pane.utf8Remaining > 0) {
+                    pane.utf8 = pane.utf8 << 6 | (c & 0x3f);
+                    if (--pane.utf8Remaining == 0) {
+                        panePrint(pane.utf8);
+                    }
+                }
+            } else {
+                pane.utf8Remaining = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+                pane.utf8 = c & (0x3f >> pane.utf8Remaining);
+            }
+            break;
+        case VT_EXECUTE:
+            paneExecute(c);
+            break;
+        case VT_CLEAR:
+            pane.paramCount = 0;
+            pane.intermediate = 0;
+            break;
+        case VT_COLLECT:
+            if (pane.intermediate == 0) {
+                pane.intermediate = c;
+            }
+            break;
+        case VT_PARAM:
+            if (pane.paramCount == 0) {
+                pane.params[pane.paramCount++] = 0;
+            }
+            if (c == ';' || c == ':') {
+                if (pane.paramCount < PANE_MAX_PARAMS) {
+                    pane.params[pane.paramCount++] = 0;
+                }
+            } else {
+                int *param = &pane.params[pane.paramCount - 1];
+                *param = min(*param * 10 + (c - '0'), 65535);
+            }
+            break;
+        case VT_ESC_DISPATCH:
+            paneEscDispatch(c);
+            break;
+        case VT_CSI_DISPATCH:
+            paneCsiDispatch(c);
+            break;
+        }
+    }
+}
+
+/* Starts the shell on a new pty sized to the pane. */
+int paneStartShell() {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        if (master != -1) {
+            close(master);
+        }
+        return -1;
+    }
+    struct winsize size = { pane.rows, pane.columns, 0, 0 };
+    ioctl(master, TIOCSWINSZ, &size);
+    char *slaveName = ptsname(master);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        int slave = open(slaveName, O_RDWR);
+        if (slave == -1) {
+            _exit(127);
+        }
+        ioctl(slave, TIOCSCTTY, 0);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(slave);
+        close(master);
+        setenv("TERM", "vt100", 1);
+        char *shell = getenv("SHELL");
+        execl(shell ? shell : "/bin/sh", shell ? shell : "/bin/sh", (char *) NULL);
+        _exit(127);
+    }
+    if (pid == -1) {
+        close(master);
+        return -1;
+    }
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    pane.fd = master;
+    pane.pid = pid;
+    return 0;
+}
+
+void paneOpen() {
+    int height = state.rows / 2;
+    if (height < 3) {
+        editorSetStatusMessage("not enough room for a terminal pane");
+        return;
+    }
+    pane.top = state.rows - height;
+    pane.rows = height - 1; // below the title bar
+    pane.columns = state.columns;
+    pane.cells = malloc(pane.rows * pane.columns * sizeof(unsigned int));
+    pane.damageFrom = calloc(pane.rows, sizeof(int));
+    pane.damageTo = calloc(pane.rows, sizeof(int));
+    pane.scrollback = malloc(PANE_SCROLLBACK * sizeof(struct Line));
+    pane.scrollbackStart = pane.scrollbackCount = pane.scroll = 0;
+    pane.vtState = VT_GROUND;
+    pane.utf8Remaining = 0;
+    pane.lastRender = 0;
+    paneReset();
+    if (paneStartShell() == -1) {
+        free(pane.cells);
+        free(pane.damageFrom);
+        free(pane.damageTo);
+        free(pane.scrollback);
+        editorSetStatusMessage("failed to start the shell");
+        return;
+    }
+    pane.open = 1;
+    pane.focused = 1;
+    state.rows = pane.top;
+    state.cy = min(state.cy, state.rows - 1);
+}
+
+void paneClose() {
+    close(pane.fd);
+    kill(pane.pid, SIGHUP);
+    waitpid(pane.pid, NULL, 0);
+    for (int i = 0; i < pane.scrollbackCount; i++) {
+        lineRelease(&pane.scrollback[(pane.scrollbackStart + i) % PANE_SCROLLBACK]);
+    }
+    free(pane.scrollback);
+    free(pane.cells);
+    free(pane.damageFrom);
+    free(pane.damageTo);
+    state.rows = pane.top + pane.rows + 1;
+    pane.open = 0;
+    pane.focused = 0;
+}
+
+/* Handles the output that is ready, up to a budget; returns 0 when the shell has gone. */
+int paneReadOutput() {
+    unsigned char buffer[16 * 1024];
+    int total = 0;
+    while (total < PANE_READ_BUDGET) {
+        int n = read(pane.fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            paneFeed(buffer, n);
+            total += n;
+        } else if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        } else {
+            return 0; // EIO once the shell has exited
+        }
+    }
+    if (total > 0 && pane.scroll > 0) {
+        pane.scroll = 0; // new output brings the view back to the shell
+        paneDamageAll();
+    }
+    return 1;
+}
+
+void paneWrite(const char *data, int length) {
+    while (length > 0) {
+        int n = write(pane.fd, data, length);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+/* Appends columns [from, to) of the displayed row, honoring the scrollback view. */
+void paneAppendRow(int row, int from, int to) {
+    int line = pane.scrollbackCount - pane.scroll + row;
+    if (line < pane.scrollbackCount) {
+        struct Line *kept = &pane.scrollback[(pane.scrollbackStart + line) % PANE_SCROLLBACK];
+        backBufferAppend(kept->chars, kept->length); // at most one row of characters, and always redrawn whole
+        backBufferAppend(ESC "[K", 3);
+        return;
+    }
+    unsigned int *cells = &pane.cells[(line - pane.scrollbackCount) * pane.columns];
+    char bytes[4];
+    for (int column = from; column < to; column++) {
+        backBufferAppend(bytes, utf8Encode(cells[column], bytes));
+    }
+}
+
+void paneDrawTitle() {
+    const char *title = pane.focused ? " shell - CTRL+T returns to the editor" : " shell - CTRL+T to type into it";
+    int length = min(strlen(title), state.columns);
+    backBufferAppend(ESC "[7m", 4);
+    backBufferAppend(title, length);
+    for (; length < state.columns; length++) {
         backBufferAppend(" ", 1);
-        length++;
     }
-    backBufferAppend(ESC "[m", 3);
+    backBufferAppend(ESC "[m\r\n", 5);
+}
+
+/* Draws the whole pane, as part of a full repaint. */
+void paneDraw() {
+    if (!pane.open) {
+        return;
+    }
+    paneDrawTitle();
+    for (int row = 0; row < pane.rows; row++) {
+        paneAppendRow(row, 0, pane.columns);
+        pane.damageFrom[row] = pane.damageTo[row] = 0;
+        backBufferAppend("\r\n", 2);
+    }
+    pane.damaged = 0;
+    pane.lastRender = nowMillis();
+}
+
+/* Where the terminal cursor goes when the pane has the focus. */
+int paneCursor(int *x, int *y) {
+    if (!pane.focused) {
+        return 0;
+    }
+    *x = pane.cursorColumn;
+    *y = pane.top + 1 + pane.cursorRow;
+    return 1;
+}
+
+/* Redraws only the damaged spans of the pane, without touching the rest of the screen. */
+void paneRenderDamage() {
+    backBufferClear();
+    backBufferAppend(ESC "[?25l", 6);
+    for (int row = 0; row < pane.rows; row++) {
+        int from = pane.scroll > 0 ? 0 : pane.damageFrom[row];
+        int to = pane.scroll > 0 ? pane.columns : pane.damageTo[row];
+        if (from == to) {
+            continue;
+        }
+        char position[32];
+        backBufferAppend(position, snprintf(position, sizeof(position), ESC "[%d;%dH", pane.top + 2 + row, from + 1));
+        paneAppendRow(row, from, to);
+        pane.damageFrom[row] = pane.damageTo[row] = 0;
+    }
+    int x = state.cx, y = state.cy;
+    paneCursor(&x, &y);
+    char position[32];
+    backBufferAppend(position, snprintf(position, sizeof(position), ESC "[%d;%dH" ESC "[?25h", y + 1, x + 1));
+    backBufferRender();
+    pane.damaged = 0;
+    pane.lastRender = nowMillis();
+}
+
+void paneScrollBack(int lines) {
+    int scroll = max(0, min(pane.scrollbackCount, pane.scroll + lines));
+    if (scroll != pane.scroll) {
+        pane.scroll = scroll;
+        paneDamageAll();
+    }
 }
 
 /** INPUT HANDLER ************************************************************/
 
+#define WHEEL_STEP 3 // lines per wheel notch
+
 enum Key {
     ESCAPE = 0x1b,
     ARROW_LEFT = 0x400,
@@ -273,15 +3873,114 @@ enum Key {
     PAGE_DOWN,
     HOME,
     END,
-    DELETE
+    DELETE,
+    SEQUENCE, // an escape sequence with no key of its own here, its bytes in input.key
+    MOUSE_PRESS,
+    MOUSE_DRAG,
+    MOUSE_RELEASE,
+    WHEEL_UP,
+    WHEEL_DOWN,
+    IGNORED
 };
 
+struct Mouse {
+    int x, y; // screen cell of the last mouse event
+    int selecting; // the left button went down on the text, so dragging selects
+} mouse;
+
+/* Everything read from the terminal and not handled yet; one read can bring many keys. */
+struct InputBuffer {
+    char data[4096];
+    int length;
+    int position;
+    char key[16]; // the bytes of the last key, so that one without a meaning here can go on as it came
+    int keyLength;
+} input;
+
+int inputPending() {
+    return input.position < input.length;
+}
+
+/* Appends what the terminal has sent; waits at most VTIME for it. */
+int inputFill() {
+    if (input.position > 0) {
+        memmove(input.data, &input.data[input.position], input.length - input.position);
+        input.length -= input.position;
+        input.position = 0;
+    }
+    int n = read(STDIN_FILENO, &input.data[input.length], sizeof(input.data) - input.length);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) {
+        die("read");
+    }
+    if (n > 0) {
+        input.length += n;
+    }
+    return n > 0;
+}
+
+/* Next input byte, or -1 if nothing comes in time. */
+int inputNext() {
+    if (!inputPending() && !inputFill()) {
+        return -1;
+    }
+    return (unsigned char) input.data[input.position++];
+}
+
+/* The next byte of the key being read, kept in input.key. */
+int keyNext() {
+    int c = inputNext();
+    if (c != -1 && input.keyLength < (int) sizeof(input.key)) {
+        input.key[input.keyLength++] = c;
+    }
+    return c;
+}
+
+/* SGR mouse report: ESC [ < button ; x ; y (M = press or motion, m = release). */
+int readMouse() {
+    int values[3] = {0, 0, 0};
+    int i = 0;
+    int c;
+    while ((c = inputNext()) != -1) {
+        if (isdigit(c)) {
+            values[i] = values[i] * 10 + (c - '0');
+        } else if (c == ';' && i < 2) {
+            i++;
+        } else {
+            break;
+        }
+    }
+    if (c != 'M' && c != 'm') {
+        return IGNORED;
+    }
+    int button = values[0];
+    mouse.x = values[1] - 1;
+    mouse.y = values[2] - 1;
+    if (button & 64) {
+        return (button & 1) ? WHEEL_DOWN : WHEEL_UP;
+    }
+    if ((button & 3) != 0) {
+        return IGNORED; // only the left button is used
+    }
+    if (c == 'm') {
+        return MOUSE_RELEASE;
+    }
+    return (button & 32) ? MOUSE_DRAG : MOUSE_PRESS;
+}
+
 int readKey() {
-    char c = 0;
-    while (read(STDIN_FILENO, &c, 1) != 1);
+    int c;
+    input.keyLength = 0;
+    while ((c = keyNext()) == -1);
     if (c == ESCAPE) {
-        char sequence[3];
-        for (int i = 0; i < 3 && read(STDIN_FILENO, &sequence[i], 1) == 1; i++);
+        int sequence[3];
+        sequence[0] = keyNext();
+        if (sequence[0] == -1) {
+            return ESCAPE;
+        }
+        if (sequence[0] != '[' && sequence[0] != 'O') {
+            return SEQUENCE; // Alt and a key
+        }
+        sequence[1] = keyNext();
         if (sequence[0] == '[') {
             switch (sequence[1]) {
             case 'A': return ARROW_UP;
@@ -290,32 +3989,137 @@ int readKey() {
             case 'D': return ARROW_LEFT;
             case 'F': return END;
             case 'H': return HOME;
-            
-            case '1': return HOME;
-            case '3': return DELETE;
-            case '4': return END;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME;
-            case '8': return END;
-            }
-        } else if (sequence[0] == 'O') {
+            case '<': return readMouse();
+            }
+            if (sequence[1] >= '0' && sequence[1] <= '9') {
+                sequence[2] = keyNext();
+                if (sequence[2] == '~') {
+                    switch (sequence[1]) {
+                    case '1': return HOME;
+                    case '3': return DELETE;
+                    case '4': return END;
+                    case '5': return PAGE_UP;
+                    case '6': return PAGE_DOWN;
+                    case '7': return HOME;
+                    case '8': return END;
+                    }
+                }
+                // parameters go on up to the final byte, as in ESC [ 1 5 ~ or ESC [ 1 ; 5 A
+                while (sequence[2] != -1 && !(sequence[2] >= 0x40 && sequence[2] <= 0x7e)) {
+                    sequence[2] = keyNext();
+                }
+            }
+        } else {
             switch (sequence[1]) {
             case 'F': return END;
             case 'H': return HOME;
             }
         }
-        return ESCAPE;
+        return SEQUENCE;
     }
     return c;
 }
 
-void handleKeyPress() {
-    int c = readKey();
-    
+/*
+ * Reads what was typed while a command runs; returns 1 if it asks to stop it
+ * (ESC or Ctrl-C), dropping other keys, and -1 if there was nothing to read.
+ */
+int inputInterrupted() {
+    if (!inputPending() && !inputFill()) {
+        return -1; // end of input: stdin is not a terminal, or it hung up
+    }
+    int interrupted = 0;
+    do {
+        int c = readKey();
+        interrupted = interrupted || c == ESCAPE || c == CONTROL('c');
+    } while (inputPending());
+    return interrupted;
+}
+
+/* Reads a line of text in the status bar; returns NULL if cancelled with ESC. */
+char *editorPrompt(const char *prompt) {
+    editorCopyWait();
+    size_t capacity = 128;
+    size_t length = 0;
+    char *text = malloc(capacity);
+    text[0] = '\0';
+
+    while (1) {
+        char message[256];
+        snprintf(message, sizeof(message), "%s%s", prompt, text);
+        editorSetStatusMessage(message);
+        editorRefreshScreen();
+
+        int c = readKey();
+        if (c == ESCAPE) {
+            editorSetStatusMessage("");
+            free(text);
+            return NULL;
+        } else if (c == '\r') {
+            editorSetStatusMessage("");
+            return text;
+        } else if (c == 0x7f || c == CONTROL('h')) {
+            if (length > 0) {
+                text[--length] = '\0';
+            }
+        } else if (c >= 0x20 && c < 0x7f) {
+            if (length + 1 >= capacity) {
+                capacity *= 2;
+                text = realloc(text, capacity);
+            }
+            text[length++] = c;
+            text[length] = '\0';
+        }
+    }
+}
+
+void editorCommand() {
+    char *command = editorPrompt(":");
+    if (command == NULL) {
+        return;
+    }
+    if (strcmp(command, "sort") == 0) {
+        editorSortLines();
+    } else if (strcmp(command, "uniq") == 0) {
+        editorUniqueLines();
+    } else if (strcmp(command, "minimap") == 0) {
+        minimapToggle();
+    } else if (strcmp(command, "collapse") == 0 || strncmp(command, "collapse ", 9) == 0) {
+        collapseCommand(command[8] == ' ' ? &command[9] : NULL);
+    } else if (strcmp(command, "budget") == 0 || strncmp(command, "budget ", 7) == 0) {
+        memoryCommand(command[6] == ' ' ? &command[7] : NULL);
+    } else if (strcmp(command, "w") == 0 || strcmp(command, "wr") == 0 || strncmp(command, "w ", 2) == 0 || strncmp(command, "wr ", 3) == 0) {
+        editorWriteCommand(command);
+    } else if (command[0] != '\0') {
+        editorSetStatusMessage("unknown command");
+    }
+    free(command);
+}
+
+void editorFilter() {
+    char *command = editorPrompt("!");
+    if (command != NULL && command[0] != '\0') {
+        editorFilterLines(command);
+    }
+    free(command);
+}
+
+void editorMoveCursorToMouse() {
+    state.cx = max(0, min(state.columns - 1, mouse.x));
+    state.cy = max(0, min(state.rows - 1, mouse.y));
+}
+
+/* Rows past the end of the file all map to the position just after the last line. */
+struct Position editorCursorPosition() {
+    struct Position position = { min(editorRowLine(state.lineOffset + state.cy), state.lineCount), max(0, state.cx - editorGutter()) };
+    return position;
+}
+
+void handleKeyPress(int c) {
     switch (c) {
     case ESCAPE:
     case CONTROL('q'):
+        clipboardAbort();
         terminalClearScreen();
         exit(0);
         break;
@@ -334,7 +4138,7 @@ void handleKeyPress() {
     case ARROW_DOWN:
         state.cy = min(state.rows - 1, state.cy + 1);
         if (state.cy == state.rows - 1) {
-            state.lineOffset = min(state.lineOffset + 1, state.lineCount);
+            state.lineOffset = min(state.lineOffset + 1, editorRowCount());
         }
         break;
     case PAGE_UP:
@@ -343,7 +4147,7 @@ void handleKeyPress() {
         break;
     case PAGE_DOWN:
         //state.cy = max(0, state.cy + state.rows);
-        state.lineOffset = min(state.lineOffset + state.rows, state.lineCount);
+        state.lineOffset = min(state.lineOffset + state.rows, editorRowCount());
         break;
     case HOME:
         state.cx = 0;
@@ -351,6 +4155,100 @@ void handleKeyPress() {
     case END:
         state.cx = state.columns - 1;
         break;
+    case CONTROL('c'):
+        editorCopySelection();
+        break;
+    case ':':
+        editorCommand();
+        break;
+    case '!':
+        editorFilter();
+        break;
+    case CONTROL('t'):
+        if (pane.open) {
+            pane.focused = 1;
+        } else {
+            paneOpen();
+        }
+        break;
+    case MOUSE_PRESS:
+        mouse.selecting = 0;
+        if (pane.open && mouse.y > pane.top && mouse.y <= pane.top + pane.rows) {
+            pane.focused = 1;
+        } else if (mouse.y < state.rows) {
+            mouse.selecting = 1;
+            editorMoveCursorToMouse();
+            state.selection.active = 0;
+            state.selection.anchor = editorCursorPosition();
+            state.selection.head = state.selection.anchor;
+        }
+        break;
+    case MOUSE_DRAG:
+        if (!mouse.selecting) {
+            break; // the press was on the pane or the status bar
+        }
+        editorMoveCursorToMouse();
+        state.selection.head = editorCursorPosition();
+        state.selection.active = positionCompare(state.selection.anchor, state.selection.head) != 0;
+        break;
+    case MOUSE_RELEASE:
+        mouse.selecting = 0;
+        break;
+    }
+}
+
+/* Sends a key to the shell the way a terminal would encode it. */
+void paneSendKey(int c) {
+    switch (c) {
+    case ARROW_UP: paneWrite(ESC "[A", 3); break;
+    case ARROW_DOWN: paneWrite(ESC "[B", 3); break;
+    case ARROW_RIGHT: paneWrite(ESC "[C", 3); break;
+    case ARROW_LEFT: paneWrite(ESC "[D", 3); break;
+    case HOME: paneWrite(ESC "[H", 3); break;
+    case END: paneWrite(ESC "[F", 3); break;
+    case PAGE_UP: paneWrite(ESC "[5~", 4); break;
+    case PAGE_DOWN: paneWrite(ESC "[6~", 4); break;
+    case DELETE: paneWrite(ESC "[3~", 4); break;
+    case SEQUENCE: paneWrite(input.key, input.keyLength); break;
+    default:
+        if (c >= 0 && c < 0x100) {
+            char byte = c;
+            paneWrite(&byte, 1);
+        }
+    }
+}
+
+/*
+ * Handles everything that came in one read before the screen is drawn again.
+ * Wheel notches are summed up and applied as one scroll, so a burst of them
+ * from a trackpad costs one repaint instead of dozens.
+ */
+void handleInput() {
+    int scroll = 0;
+    do {
+        int c = readKey();
+        if (c == WHEEL_UP) {
+            scroll -= WHEEL_STEP;
+        } else if (c == WHEEL_DOWN) {
+            scroll += WHEEL_STEP;
+        } else if (pane.focused && c == CONTROL('t')) {
+            pane.focused = 0;
+        } else if (pane.focused && c < MOUSE_PRESS) {
+            paneSendKey(c);
+        } else {
+            if (pane.focused && c == MOUSE_PRESS) {
+                pane.focused = 0; // unless the press lands on the pane again
+            }
+            handleKeyPress(c);
+        }
+    } while (inputPending());
+
+    if (scroll != 0) {
+        if (pane.open && mouse.y > pane.top && mouse.y <= pane.top + pane.rows) {
+            paneScrollBack(-scroll);
+        } else {
+            state.lineOffset = max(0, min(state.lineOffset + scroll, editorRowCount()));
+        }
     }
 }
 
@@ -358,25 +4256,63 @@ void handleKeyPress() {
 
 int main(int argc, char *argv[]) {
     terminalRawMode();
+    terminalMouseOn();
     editorInit();
+    char *budget = getenv("KILO_MEMORY_BUDGET"); // MB, so that huge files load within it
+    if (budget != NULL) {
+        memory.budget = atoll(budget) << 20;
+    }
     if (argc > 1) {
         editorOpenFile(argv[1]);
     }
     backBufferInit(state.columns * state.rows * 8);
     terminalClearScreen();
 
-    editorSetStatusMessage("HELP: press CTRL+Q to quit");
+    editorSetStatusMessage("HELP: press CTRL+Q to quit, : for a command (sort, uniq, minimap, collapse, w, wr, budget), ! to filter through a shell command, CTRL+T for a shell");
+    vtInit();
 
+    /*
+     * Keys come first: they are handled and the whole screen is redrawn.
+     * Shell output only damages the pane, which is redrawn by itself at
+     * most once per frame, however much output arrives in between.
+     */
+    int refresh = 1;
     while (1) {
-        terminalCursorHide();
-        terminalCursorHome();
-        backBufferClear();
-        editorDrawLines();
-        backBufferRender();
-        terminalSetCursorPosition(state.cx, state.cy);
-        terminalCursorShow();
-
-        handleKeyPress();
+        if (refresh && !clipboardPending()) {
+            memoryEnforce();
+            editorRefreshScreen();
+            refresh = 0;
+        }
+        struct pollfd fds[3] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { pane.open ? pane.fd : -1, POLLIN, 0 },
+            { clipboardPending() ? STDOUT_FILENO : -1, POLLOUT, 0 }
+        };
+        int timeout = -1;
+        if (pane.open && pane.damaged && !clipboardPending()) {
+            timeout = max(0, PANE_FRAME_MS - (int) (nowMillis() - pane.lastRender));
+        }
+        if (!inputPending() && poll(fds, 3, timeout) == -1 && errno != EINTR) {
+            die("poll");
+        }
+
+        if (fds[2].revents != 0) {
+            clipboardDrain();
+            editorCopyContinue();
+            refresh = refresh || !clipboardPending();
+        }
+
+        if (inputPending() || (fds[0].revents & POLLIN)) {
+            handleInput();
+            refresh = 1;
+        }
+        if (pane.open && fds[1].revents != 0 && !paneReadOutput()) {
+            paneClose();
+            refresh = 1;
+        }
+        if (!refresh && pane.open && pane.damaged && !clipboardPending() && nowMillis() - pane.lastRender >= PANE_FRAME_MS) {
+            paneRenderDamage();
+        }
     }
     return 0;
 }